@@ -1,11 +1,25 @@
 /* modifier 0 means no modifier */
 static char *useragent      = NULL;
 static char *scriptfile     = "~/.surf/script.js";
+static char *scriptdir      = "~/.surf/scripts/";
 static char *styledir       = "~/.surf/styles/";
 static char *cachefolder    = "~/.surf/cache/";
 static char *dbfolder       = "~/.surf/databases/";
 static char *origincachefolder = "~/.surf/origins/%s/cache/";
 static char *origindbfolder = "~/.surf/origins/%s/databases/";
+static char *originusagefile = "~/.surf/origins/%s/usage";
+static char *originmetricsfile = "~/.surf/origins/%s/metrics";
+static char *originsocket   = "~/.surf/origins/%s/surf.sock";
+static char *zygotesocket   = "~/.surf/zygote.sock";
+static char *controlfolder  = "~/.surf/run/"; /* unless $XDG_RUNTIME_DIR */
+static char *downloaddir    = "~/Downloads/";
+static char *sessionfolder  = "~/.surf/session/";
+static char *harfolder      = "~/.surf/har/";
+static guint sessionrestoredelay = 0; /* seconds between windows restored
+                                         in the background, 0 waits for
+                                         them to be focused */
+static char *blockfile      = "~/.surf/blocklist.txt"; /* EasyList syntax */
+static char *blockindexfile = "~/.surf/blocklist.idx";
 
 static Bool kioskmode       = FALSE; /* Ignore shortcuts */
 static Bool showindicators  = TRUE;  /* Show indicators in window title */
@@ -22,21 +36,45 @@ static char *cookiepolicies = "Aa@"; /* A: accept all; a: accept nothing,
                                         @: accept no third party */
 static char *cafile         = "/etc/ssl/certs/ca-certificates.crt";
 static char *strictssl      = FALSE; /* Refuse untrusted SSL connections */
-static time_t sessiontime   = 3600;
+static time_t sessiontime   = 3600; /* session cookies are not saved, but
+                                       expire after this many seconds */
+static guint cookiecompact  = 1000; /* changes logged before cookiefile is
+                                       rewritten */
 
 /* Webkit default features */
 static Bool enablescrollbars      = TRUE;
 static Bool enablespatialbrowsing = TRUE;
 static Bool enablediskcache       = TRUE;
 static int diskcachebytes         = 5 * 1024 * 1024;
+static guint diskcacheflush       = 30; /* seconds to batch cache writes */
+static guint diskcachehotfactor   = 8;  /* max multiple of diskcachebytes for
+                                           often used origins */
+static guint64 diskcachebudget    = 256 * 1024 * 1024; /* all origins */
+static Bool downloadask           = TRUE;  /* where to save, see
+                                             DOWNLOADPROMPT */
+static int downloadsegments       = 4;  /* parallel requests per download */
+static goffset downloadsplit      = 8 * 1024 * 1024; /* smallest download
+                                                        fetched in segments */
 static Bool enableplugins         = TRUE;
 static Bool enablescripts         = TRUE;
+static Bool scriptmainframeonly   = FALSE; /* no user scripts in iframes */
+static Bool backgroundthrottle    = TRUE;  /* slow down pages out of
+                                             sight */
+static guint discardafter         = 0;    /* seconds out of sight before a
+                                             page is emptied, 0 keeps them */
 static Bool enableinspector       = TRUE;
 static Bool enablestyles          = TRUE;
 static Bool loadimages            = TRUE;
 static Bool hidebackground        = FALSE;
 static Bool allowgeolocation      = TRUE;
 static Bool sameoriginpolicy      = TRUE;
+static Bool enableblocking        = TRUE;  /* cancel requests blockfile
+                                             matches */
+static Bool recordmetrics         = FALSE; /* timings of every load in
+                                             originmetricsfile */
+static guint metricsbytes         = 256 * 1024; /* originmetricsfile size
+                                                   before it is moved to
+                                                   <file>.old */
 #define PROMPT_GO    "Go to"
 #define PROMPT_FIND  "Find"
 #define PROMPT_FIND2 "/"
@@ -50,18 +88,13 @@ static Bool sameoriginpolicy      = TRUE;
 	} \
 }
 
-/* DOWNLOAD(URI, referer) */
-#define DOWNLOAD(d, r) { \
+/* DOWNLOADPROMPT(path) */
+/* This prints where a download is to be saved, path being suggested, or
+ * nothing to cancel it.
+ */
+#define DOWNLOADPROMPT(p) { \
 	.v = (char *[]){ "/bin/sh", "-c", \
-		"D=\"`printf \"${PWD}\n${HOME}\n${HOME}/Downloads\n\" | dmenu -p 'Save into' -l 3`\" &&" \
-		"mkdir -p \"${D}\" && cd \"${D}\" &&" \
-		"N=\"`basename \"$0\"`\" &&" \
-		"F=\"`echo \"${N}\" | dmenu -p 'Save as'`\" &&" \
-		"st -e /bin/sh -c \"" \
-			"curl -L -J -o '$F' --user-agent '$1' --referer '$2' -b $3 -c $3 '$0';" \
-			"echo 'Press Enter to close window...'; read y" \
-		"\"", \
-		d, (useragent ? useragent : ""), r, cookiefile, NULL \
+		"echo \"$0\" | dmenu -p 'Save as'", p, NULL \
 	} \
 }
 
@@ -77,14 +110,25 @@ static Bool sameoriginpolicy      = TRUE;
 
 /* styles */
 /*
- * The iteration will stop at the first match, beginning at the beginning of
- * the list.
+ * The regexps are matched against the origin of the page, like
+ * https://example.com, and the iteration will stop at the first match,
+ * beginning at the beginning of the list.
  */
 static SiteStyle styles[] = {
 	/* regexp		file in $styledir */
 	{ ".*",			"default.css" },
 };
 
+/* scripts */
+/*
+ * Every script whose regexp matches the uri of a frame is run in it, after
+ * scriptfile.
+ */
+static SiteScript scripts[] = {
+	/* regexp		file in $scriptdir */
+	{ ".*",			"default.js" },
+};
+
 #define MODKEY GDK_CONTROL_MASK
 
 /* hotkeys */
@@ -0,0 +1,592 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * surf-bench measures the time from a link click to the first visually
+ * non-empty layout of the page it leads to, for links within an origin and
+ * for links to another origin, which surf opens in a process of its own.
+ *
+ * Everything runs offline: surf is started under Xvfb, with an HTTP proxy
+ * of ours serving made up pages for every host name, and with its own home
+ * and runtime directories. The clicks are driven through the control socket
+ * of each window, the paints are read from the SURF_TRACE files.
+ *
+ * With -m it instead fills a home directory with made up cookies and the
+ * like, and has surf time its hot paths on them, see benchmicro() in surf.c.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LENGTH(x)  (sizeof(x) / sizeof((x)[0]))
+#define MAXCONNS   64
+#define TIMEOUT    (20 * 1000000LL)
+
+typedef struct {
+	int fd;
+	size_t len;
+	char buf[8192];
+} Conn;
+
+static void cleanup(void);
+static void die(const char *errstr, ...);
+static void micro(const char *surf);
+static void urigen(const char *path);
+static long long now(void);
+static int percentile(const void *a, const void *b);
+static void report(const char *what, long long *v, int n);
+static void serve(int lfd);
+static void serveconn(Conn *c);
+static long long waitpaint(long long since);
+static int waitsocket(const char *origin);
+static void waitloaded(int fd);
+static char *command(int fd, const char *fmt, ...);
+
+static char tmpdir[] = "/tmp/surf-bench.XXXXXX";
+static char tracedir[64], rundir[64], homedir[64];
+static pid_t server = -1, xvfb = -1;
+
+/* stops every surf process which has written a trace, and everything else */
+static void
+cleanup(void) {
+	struct dirent *e;
+	pid_t pid;
+	DIR *d;
+
+	if((d = opendir(tracedir))) {
+		while((e = readdir(d))) {
+			if(sscanf(e->d_name, "surf-%d.json", &pid) == 1)
+				kill(pid, SIGTERM);
+		}
+		closedir(d);
+	}
+	if(server > 0)
+		kill(server, SIGTERM);
+	if(xvfb > 0)
+		kill(xvfb, SIGTERM);
+	while(wait(NULL) > 0 || errno == EINTR);
+
+	if((pid = fork()) == 0) {
+		execlp("rm", "rm", "-rf", tmpdir, (char *)NULL);
+		_exit(1);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static char *
+command(int fd, const char *fmt, ...) {
+	static char reply[4096];
+	char cmd[1024];
+	va_list ap;
+	size_t len = 0;
+	ssize_t n;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	if(write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+		die("surf-bench: lost the control socket\n");
+
+	while(len < sizeof(reply) - 1) {
+		if((n = read(fd, reply + len, 1)) <= 0)
+			die("surf-bench: lost the control socket\n");
+		if(reply[len++] == '\n')
+			break;
+	}
+	reply[len] = '\0';
+	return reply;
+}
+
+static void
+die(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	cleanup();
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Writes 10000 uris of the kinds a page requests: scripts and images of
+ * content networks, tracking pixels with long queries, favicons, and now
+ * and then an about:, blob: or long data: uri.
+ */
+static void
+urigen(const char *path) {
+	FILE *f;
+	int i, j;
+
+	if(!(f = fopen(path, "w")))
+		die("surf-bench: cannot write %s\n", path);
+	for(i = 0; i < 10000; i++) {
+		switch(i % 20) {
+		case 0:
+			fprintf(f, "https://o%d.bench.test/favicon.ico\n", i);
+			break;
+		case 1:
+			fprintf(f, "about:blank\n");
+			break;
+		case 2:
+			fprintf(f, "blob:https://o%d.bench.test/%08x-4d2e-"
+					"9c1a-%012x\n", i % 50, i, i * 7919);
+			break;
+		case 3:
+			fputs("data:image/png;base64,", f);
+			for(j = 0; j < (i % 100 == 3 ? 65536 : 256); j++)
+				fputc("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdef"[j % 32],
+						f);
+			fputc('\n', f);
+			break;
+		case 4: case 5: case 6: case 7:
+			fprintf(f, "http://ads%d.tracker.test/pixel.gif?id=%d"
+					"&ref=https%%3A%%2F%%2Fo%d.bench.test%%2F"
+					"page%%3Fq%%3D%d&cb=%d\n", i % 7, i,
+					i % 50, i, i * 31);
+			break;
+		default:
+			fprintf(f, "https://cdn%d.bench.test/assets/%s/%x."
+					"%s?v=%d\n", i % 5, i % 2 ? "js" : "img",
+					i * 2654435761u, i % 2 ? "js" : "png",
+					i % 13);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+/* runs the micro benchmarks of surf, on files written for them */
+static void
+micro(const char *surf) {
+	char path[PATH_MAX];
+	pid_t pid;
+	FILE *f;
+	int i, status;
+
+	snprintf(path, sizeof(path), "%s/.surf", homedir);
+	mkdir(path, 0700);
+
+	/* 2000 cookies, and a log of another process changing them */
+	snprintf(path, sizeof(path), "%s/.surf/cookies.txt", homedir);
+	if(!(f = fopen(path, "w")))
+		die("surf-bench: cannot write %s\n", path);
+	for(i = 0; i < 2000; i++) {
+		fprintf(f, "o%d.bench.test\tFALSE\t/\tFALSE\t4102444800\t"
+				"c%d\tv0\n", i / 10, i % 10);
+	}
+	fclose(f);
+	snprintf(path, sizeof(path), "%s/.surf/cookies.txt.log", homedir);
+	if(!(f = fopen(path, "w")))
+		die("surf-bench: cannot write %s\n", path);
+	for(i = 0; i < 20000; i++) {
+		if(i % 4 == 3) {
+			fprintf(f, "-1\to%d.bench.test\t/\tc%d\n",
+					i % 2000 / 10, i % 10);
+		} else {
+			fprintf(f, "+1\to%d.bench.test\tFALSE\t/\tFALSE\t"
+					"4102444800\tc%d\tv%d\n",
+					i % 2000 / 10, i % 10, i);
+		}
+	}
+	fclose(f);
+
+	/* 20000 host rules and 5000 substring rules, EasyList style */
+	snprintf(path, sizeof(path), "%s/.surf/blocklist.txt", homedir);
+	if(!(f = fopen(path, "w")))
+		die("surf-bench: cannot write %s\n", path);
+	fprintf(f, "[Adblock Plus 2.0]\n! made up by surf-bench\n");
+	for(i = 0; i < 20000; i++)
+		fprintf(f, "||ads%d.tracker%d.test^\n", i % 7, i);
+	fprintf(f, "||ads1.tracker.test^\n||ads2.tracker.test^\n");
+	for(i = 0; i < 5000; i++)
+		fprintf(f, "/banner%d/ad-\n", i);
+	fprintf(f, "/pixel.gif?id=1\n");
+	fclose(f);
+
+	/* request uris, unless a recorded corpus was given */
+	if(!getenv("SURF_BENCH_URIS")) {
+		snprintf(path, sizeof(path), "%s/uris.txt", tmpdir);
+		urigen(path);
+		setenv("SURF_BENCH_URIS", path, 1);
+	}
+
+	setenv("HOME", homedir, 1);
+	setenv("SURF_BENCH", "micro", 1);
+	if((pid = fork()) == 0) {
+		execl(surf, surf, (char *)NULL);
+		fprintf(stderr, "surf-bench: cannot run %s\n", surf);
+		_exit(1);
+	}
+	if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)
+			|| WEXITSTATUS(status))
+		die("surf-bench: %s failed\n", surf);
+}
+
+/* in microseconds, on the clock the traces of surf use */
+static long long
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int
+percentile(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *what, long long *v, int n) {
+	if(n == 0)
+		return;
+	qsort(v, n, sizeof(*v), percentile);
+	printf("%-14s %4d clicks  p50 %7.1f ms  p95 %7.1f ms\n", what, n,
+			v[n / 2] / 1000.0, v[(n * 95 + 99) / 100 - 1] / 1000.0);
+}
+
+/* a proxy which makes up a page for any uri, until killed */
+static void
+serve(int lfd) {
+	struct pollfd pfd[MAXCONNS + 1];
+	Conn conns[MAXCONNS];
+	int i, n, fd;
+	ssize_t r;
+
+	for(i = 0; i < MAXCONNS; i++)
+		conns[i].fd = -1;
+	for(;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for(i = 0; i < MAXCONNS; i++) {
+			pfd[i + 1].fd = conns[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		if(poll(pfd, LENGTH(pfd), -1) == -1)
+			continue;
+
+		if(pfd[0].revents & POLLIN
+				&& (fd = accept(lfd, NULL, NULL)) != -1) {
+			for(n = 0; n < MAXCONNS && conns[n].fd != -1; n++);
+			if(n == MAXCONNS) {
+				close(fd);
+			} else {
+				conns[n].fd = fd;
+				conns[n].len = 0;
+			}
+		}
+		for(i = 0; i < MAXCONNS; i++) {
+			if(conns[i].fd == -1 || !pfd[i + 1].revents)
+				continue;
+			r = read(conns[i].fd, conns[i].buf + conns[i].len,
+					sizeof(conns[i].buf) - conns[i].len - 1);
+			if(r <= 0) {
+				close(conns[i].fd);
+				conns[i].fd = -1;
+				continue;
+			}
+			conns[i].len += r;
+			serveconn(&conns[i]);
+		}
+	}
+}
+
+/*
+ * Answers the complete requests in c. Page n of a host links to page n + 1
+ * of the same host, and to page 0 of the host o<n + 1>.bench.test.
+ */
+static void
+serveconn(Conn *c) {
+	char *end, host[256], body[4096], head[512];
+	const char *notfound = "HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\n\r\n";
+	int page, origin, i;
+	size_t len;
+
+	for(;;) {
+		c->buf[c->len] = '\0';
+		if(!(end = strstr(c->buf, "\r\n\r\n")))
+			return;
+		end += 4;
+
+		if(sscanf(c->buf, "GET http://%255[^/ ]/%d", host, &page) != 2
+				|| sscanf(host, "o%d.", &origin) != 1) {
+			if(write(c->fd, notfound, strlen(notfound)) < 0)
+				return;
+		} else {
+			len = snprintf(body, sizeof(body), "<!DOCTYPE html>"
+				"<html><head><title>%s %d</title></head>"
+				"<body><h1>%s, page %d</h1>"
+				"<p><a id=\"same\" href=\"http://%s/%d\">next "
+				"page</a> <a id=\"cross\" "
+				"href=\"http://o%d.bench.test/0\">next origin"
+				"</a></p>", host, page, host, page, host,
+				page + 1, origin + 1);
+			for(i = 0; i < 20 && len < sizeof(body) - 200; i++) {
+				len += snprintf(body + len, sizeof(body) - len,
+					"<p>Paragraph %d of filler text, so "
+					"there is something to lay out.</p>",
+					i);
+			}
+			len += snprintf(body + len, sizeof(body) - len,
+					"</body></html>");
+			snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: text/html\r\n"
+				"Cache-Control: no-store\r\n"
+				"Content-Length: %zu\r\n\r\n", len);
+			if(write(c->fd, head, strlen(head)) < 0
+					|| write(c->fd, body, len) < 0)
+				return;
+		}
+		c->len -= end - c->buf;
+		memmove(c->buf, end, c->len);
+	}
+}
+
+/* the time of the first paint after since, in any surf process */
+static long long
+waitpaint(long long since) {
+	char path[PATH_MAX], line[512], *ts;
+	struct dirent *e;
+	long long t, first, deadline = now() + TIMEOUT;
+	DIR *d;
+	FILE *f;
+
+	for(;;) {
+		first = 0;
+		if(!(d = opendir(tracedir)))
+			die("surf-bench: cannot open %s\n", tracedir);
+		while((e = readdir(d))) {
+			if(e->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", tracedir,
+					e->d_name);
+			if(!(f = fopen(path, "r")))
+				continue;
+			while(fgets(line, sizeof(line), f)) {
+				if(!strstr(line, "\"load_first_visual_layout\"")
+						|| !(ts = strstr(line, "\"ts\":")))
+					continue;
+				t = strtoll(ts + 5, NULL, 10);
+				if(t > since && (!first || t < first))
+					first = t;
+			}
+			fclose(f);
+		}
+		closedir(d);
+		if(first)
+			return first;
+		if(now() > deadline)
+			die("surf-bench: no page painted\n");
+		usleep(2000);
+	}
+}
+
+/* waits until the page in the window behind fd has finished loading */
+static void
+waitloaded(int fd) {
+	long long deadline = now() + TIMEOUT;
+
+	while(strncmp(command(fd, "status\n"), "ok 100 ", 7)) {
+		if(now() > deadline)
+			die("surf-bench: page does not finish loading\n");
+		usleep(5000);
+	}
+}
+
+/* connects to the control socket of the window showing origin */
+static int
+waitsocket(const char *origin) {
+	struct sockaddr_un addr;
+	struct dirent *e;
+	char suffix[300];
+	long long deadline = now() + TIMEOUT;
+	size_t len;
+	DIR *d;
+	int fd;
+
+	snprintf(suffix, sizeof(suffix), "-http_%s.sock", origin);
+	for(;;) {
+		if((d = opendir(rundir))) {
+			while((e = readdir(d))) {
+				len = strlen(e->d_name);
+				if(len < strlen(suffix) || strcmp(e->d_name
+						+ len - strlen(suffix), suffix))
+					continue;
+				memset(&addr, 0, sizeof(addr));
+				addr.sun_family = AF_UNIX;
+				/* too long to connect to, as for surf itself */
+				if(snprintf(addr.sun_path, sizeof(addr.sun_path),
+						"%s/%s", rundir, e->d_name)
+						>= (int)sizeof(addr.sun_path))
+					continue;
+				if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+					break;
+				if(connect(fd, (struct sockaddr *)&addr,
+							sizeof(addr)) == 0) {
+					closedir(d);
+					return fd;
+				}
+				close(fd);
+			}
+			closedir(d);
+		}
+		if(now() > deadline)
+			die("surf-bench: no window for %s\n", origin);
+		usleep(5000);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	long long same[256], cross[256], t0;
+	char display[16], proxy[64], uri[128], origin[64], path[PATH_MAX];
+	char line[256], runtime[64], *surf = "./surf";
+	struct dirent *e;
+	struct stat st;
+	long rss, kb;
+	int clicks = 20, nsame = 0, ncross = 0, procs = 0;
+	int lfd, fd, i, origins = 0, domicro = 0;
+	pid_t pid;
+	DIR *d;
+	FILE *f;
+
+	if(argc > 1 && !strcmp(argv[1], "-m")) {
+		domicro = 1;
+		argc--;
+		argv++;
+	}
+	if(argc > 1)
+		surf = argv[1];
+	if(argc > 2 && (clicks = atoi(argv[2])) > (int)LENGTH(same))
+		clicks = LENGTH(same);
+	setpgid(0, 0);
+
+	if(!mkdtemp(tmpdir))
+		die("surf-bench: mkdtemp: %s\n", strerror(errno));
+	snprintf(tracedir, sizeof(tracedir), "%s/trace", tmpdir);
+	snprintf(rundir, sizeof(rundir), "%s/run/surf", tmpdir);
+	snprintf(homedir, sizeof(homedir), "%s/home", tmpdir);
+	mkdir(homedir, 0700);
+	snprintf(runtime, sizeof(runtime), "%s/run", tmpdir);
+	mkdir(runtime, 0700);
+
+	if(domicro) {
+		micro(surf);
+		cleanup();
+		return EXIT_SUCCESS;
+	}
+
+	/* the proxy */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if((lfd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+			|| bind(lfd, (struct sockaddr *)&addr, sizeof(addr))
+			|| listen(lfd, 64)
+			|| getsockname(lfd, (struct sockaddr *)&addr, &addrlen))
+		die("surf-bench: cannot listen: %s\n", strerror(errno));
+	if((server = fork()) == 0) {
+		serve(lfd);
+		_exit(0);
+	}
+	close(lfd);
+
+	/* the X server */
+	snprintf(display, sizeof(display), ":%s",
+			getenv("SURF_BENCH_DISPLAY") ?
+			getenv("SURF_BENCH_DISPLAY") : "99");
+	if((xvfb = fork()) == 0) {
+		execlp("Xvfb", "Xvfb", display, "-nolisten", "tcp", "-screen",
+				"0", "1024x768x24", (char *)NULL);
+		fprintf(stderr, "surf-bench: cannot run Xvfb\n");
+		_exit(1);
+	}
+	snprintf(path, sizeof(path), "/tmp/.X11-unix/X%s", display + 1);
+	for(t0 = now(); stat(path, &st); usleep(10000)) {
+		if(now() - t0 > TIMEOUT)
+			die("surf-bench: Xvfb did not start\n");
+	}
+
+	snprintf(proxy, sizeof(proxy), "http://127.0.0.1:%d/",
+			ntohs(addr.sin_port));
+	setenv("DISPLAY", display, 1);
+	setenv("HOME", homedir, 1);
+	setenv("XDG_RUNTIME_DIR", runtime, 1);
+	setenv("SURF_TRACE", tracedir, 1);
+	setenv("http_proxy", proxy, 1);
+
+	snprintf(uri, sizeof(uri), "http://o0.bench.test/0");
+	if((pid = fork()) == 0) {
+		execl(surf, surf, uri, (char *)NULL);
+		fprintf(stderr, "surf-bench: cannot run %s\n", surf);
+		_exit(1);
+	}
+	fd = waitsocket("o0.bench.test");
+	waitloaded(fd);
+
+	for(i = 0; i < clicks; i++) {
+		if(i % 2 == 0) {
+			t0 = now();
+			command(fd, "eval document.getElementById('same')"
+					".click()\n");
+			same[nsame++] = waitpaint(t0) - t0;
+		} else {
+			t0 = now();
+			command(fd, "eval document.getElementById('cross')"
+					".click()\n");
+			cross[ncross++] = waitpaint(t0) - t0;
+			close(fd);
+			snprintf(origin, sizeof(origin), "o%d.bench.test",
+					++origins);
+			fd = waitsocket(origin);
+		}
+		waitloaded(fd);
+	}
+	close(fd);
+
+	/* every surf process has written a trace of its own */
+	rss = 0;
+	if((d = opendir(tracedir))) {
+		while((e = readdir(d))) {
+			if(sscanf(e->d_name, "surf-%d.json", &pid) != 1)
+				continue;
+			procs++;
+			snprintf(path, sizeof(path), "/proc/%d/status", pid);
+			if(!(f = fopen(path, "r")))
+				continue;
+			while(fgets(line, sizeof(line), f)) {
+				if(sscanf(line, "VmRSS: %ld", &kb) == 1)
+					rss += kb;
+			}
+			fclose(f);
+		}
+		closedir(d);
+	}
+
+	report("same origin", same, nsame);
+	report("cross origin", cross, ncross);
+	printf("%d origins, %d surf processes spawned, %ld kB resident "
+			"in all\n", origins + 1, procs - 1, rss);
+
+	cleanup();
+
+	return EXIT_SUCCESS;
+}
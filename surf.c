@@ -19,11 +19,24 @@
 #include <stdio.h>
 #include <webkit/webkit.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <JavaScriptCore/JavaScript.h>
 #include <sys/file.h>
 #include <libgen.h>
 #include <stdarg.h>
 #include <regex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "arg.h"
 
@@ -35,6 +48,12 @@ char *argv0;
 #define COOKIEJAR(obj)          (G_TYPE_CHECK_INSTANCE_CAST ((obj), COOKIEJAR_TYPE, CookieJar))
 
 enum { AtomFind, AtomGo, AtomUri, AtomLast };
+enum {
+	UriWeb     = 1 << 0, /* loaded by webkit, not plumbed */
+	UriHttps   = 1 << 1,
+	UriPrint   = 1 << 2, /* printable ASCII only */
+	UriFavicon = 1 << 3,
+};
 enum {
 	ClkDoc   = WEBKIT_HIT_TEST_RESULT_CONTEXT_DOCUMENT,
 	ClkLink  = WEBKIT_HIT_TEST_RESULT_CONTEXT_LINK,
@@ -52,17 +71,112 @@ union Arg {
 	const void *v;
 };
 
+/* milestones and traffic of the load in progress, see metricswrite() */
+typedef struct {
+	gint64 start, commit, visual;	/* monotonic, 0 until reached */
+	guint requests;
+	gint64 bytes;
+} Load;
+
+/* the requests of a load captured for HAR export, see harwrite() */
+typedef struct {
+	gint64 wall, start;	/* real and monotonic time the load started */
+	GPtrArray *entries;
+} Har;
+
 typedef struct Client {
 	GtkWidget *win, *scroll, *vbox, *pane;
 	WebKitWebView *view;
 	WebKitWebInspector *inspector;
 	char *title, *linkhover;
-	const char *needle;
+	const char *needle, *style;
 	gint progress;
 	struct Client *next;
 	gboolean zoomed, fullscreen, isinspecting, sslfailed;
+	/* window title, rebuilt at most once per main loop iteration */
+	char *wintitle;
+	char togglestat[10];
+	gboolean statdirty;
+	guint titleid;
+	/*
+	 * X properties as last written or read, writes pending in atomid
+	 * and how many of their PropertyNotify events are still to come
+	 */
+	char *atomval[AtomLast];
+	guint atomdirty, atomechoes[AtomLast], atomid;
+	/* control socket and its connections */
+	char *ctlpath;
+	int ctlfd;
+	guint ctlid;
+	GSList *controls;
+	/* scroll position to go to once loaded, or -1 */
+	gdouble restorey;
+	/* emptied while out of sight, see discard() */
+	guint discardid;
+	gboolean discarded;
+	char *discarduri;
+	gdouble discardy;
+	long discardrss;
+	gboolean background;
+	Load load;
+	Har *har;
+	gboolean harnext;	/* capture the next load, sampled or not */
 } Client;
 
+typedef struct {
+	Client *c;
+	int fd;
+	guint id, outid;	/* id is 0 once the peer has stopped sending */
+	GString *in, *out;	/* unparsed commands, unsent replies */
+} Control;
+
+#define DOWNLOADBUF (256 * 1024)
+
+typedef struct Download Download;
+
+/* a byte range of a download, fetched by a request of its own */
+typedef struct {
+	Download *d;
+	SoupMessage *msg;
+	goffset pos, end;	/* next byte to write, end of range or -1 */
+	GByteArray *buf;
+	gboolean done;
+} Segment;
+
+struct Download {
+	Client *c;
+	char *uri, *referer, *useragent;
+	char *path, *part, *state;	/* NULL while downloadprompt runs */
+	char *validator;	/* ETag or Last-Modified, for If-Range */
+	GString *answer;	/* of downloadprompt, read so far */
+	int fd;
+	goffset size, received;	/* size is -1 while unknown */
+	Segment seg[16];
+	int nseg, active;
+	gboolean failed;
+	gint64 saved;
+};
+
+/*
+ * A request captured for HAR export, monotonic times or 0 until reached.
+ * msg is the message the session sends for uri, once harqueued() found it.
+ */
+typedef struct {
+	SoupMessage *msg;
+	char *uri;
+	gint64 start, dnsstart, dns, connstart, connect, tlsstart, tls;
+	gint64 sent, headers, end;
+	goffset bytes;
+} HarEntry;
+
+/* an origin of RFC 6454, with the port only if it is not the default */
+typedef struct {
+	const char *scheme;
+	char *host;	/* host[:port], lower case, IPv6 literals in brackets */
+	char *uri;	/* scheme://host[:port] */
+	char *folder;	/* scheme_host[:port] */
+} Origin;
+
 typedef struct {
 	guint mod;
 	guint keyval;
@@ -78,23 +192,77 @@ typedef struct {
 	const Arg arg;
 } Button;
 
+/*
+ * Cookies are kept in memory. On disk there is a snapshot in cookies.txt
+ * format, and a log of the changes since then, which is only ever appended
+ * to and folded into the snapshot every cookiecompact changes.
+ */
 typedef struct {
-	SoupCookieJarText parent_instance;
-	int lock;
+	SoupCookieJar parent_instance;
+	char *filename, *logname;
+	int log;
+	guint logged;
+	off_t replayed;		/* how much of the log is in the jar */
+	ino_t snapshot;		/* of the snapshot read, a new one each compaction */
+	gboolean loading, readonly;
+	GHashTable *values;	/* value of every cookie, by cookiejar_key() */
+	GHashTable *session;	/* cookiejar_key() of the session cookies */
 } CookieJar;
 
 typedef struct {
-	SoupCookieJarTextClass parent_class;
+	SoupCookieJarClass parent_class;
 } CookieJarClass;
 
-G_DEFINE_TYPE(CookieJar, cookiejar, SOUP_TYPE_COOKIE_JAR_TEXT)
+G_DEFINE_TYPE(CookieJar, cookiejar, SOUP_TYPE_COOKIE_JAR)
 
 typedef struct {
 	char *regex;
 	char *style;
+	char *file;
 	regex_t re;
 } SiteStyle;
 
+/* a user script, read once and again only after it changed on disk */
+typedef struct {
+	char *path;
+	char *source;
+	GFileMonitor *monitor;
+} Script;
+
+typedef struct {
+	char *regex;
+	char *file;
+	regex_t re;
+	Script *script;
+} SiteScript;
+
+typedef struct {
+	char *dir;
+	guint64 size;
+	time_t used;
+} CacheUse;
+
+typedef struct {
+	char *path, *uri;
+	gint64 used;	/* ns */
+} SessionEntry;
+
+/*
+ * Header of the compiled block list, followed by
+ * - the host table: nhosts string offsets, an open addressed hash set of the
+ *   blocked hosts, 0 marking an empty slot;
+ * - the pattern buckets: npats + 1 indexes into the pattern list, patterns
+ *   are bucketed by blockanchor() of their first BLOCKANCHOR characters;
+ * - the pattern list: string offsets;
+ * - the string pool, beginning with an empty string.
+ */
+typedef struct {
+	char magic[8];
+	guint64 srcmtime, srcsize;
+	guint32 nhosts, npats;
+	guint32 hosts, buckets, patterns, strings;
+} BlockIndex;
+
 static Display *dpy;
 static Atom atoms[AtomLast];
 static Client *clients = NULL;
@@ -102,23 +270,172 @@ static GdkNativeWindow embed = 0;
 static gboolean showxid = FALSE;
 static char winid[64];
 static gboolean usingproxy = 0;
-static char togglestat[10];
 static char pagestat[3];
+static char *originstat = NULL;
 static GTlsDatabase *tlsdb;
+static GThread *tlsthread = NULL;
 static int policysel = 0;
 static char *stylefile = NULL;
 static char *origin_uri = NULL;
 static char *referring_origin = NULL;
 static SoupCache *diskcache = NULL;
+static GThread *cachethread = NULL;
+static char *usagepath = NULL;	/* originusagefile of our origin */
+static guchar randpool[4096];
+static size_t randpos = sizeof(randpool);
+static char *scrambledua = NULL;
+static gboolean scrambledlanguage = FALSE;
+static GHashTable *stylememo = NULL;
+static GSList *downloads = NULL;
+static Script *userscript = NULL;
+static const BlockIndex *blockindex = NULL;
+static size_t blockindexsize = 0;
+static guint cacheflushid = 0;
+static gboolean showstats = FALSE;
+static gdouble harsample = 0;	/* fraction of loads captured, SURF_HAR */
+static struct {
+	guint requests, network, revalidations;
+	guint64 bytes, networkbytes;
+} cachestats;
+static struct {
+	guint updates, coalesced, set;
+} titlestats;
+static struct {
+	guint roundtrips, writes, flushes;
+} xstats;
+static struct {
+	gint64 since, wall, cpu;
+} bgstats;
+
+/*
+ * Wraps the timers of a page, so that while __surfbackground is set,
+ * timeouts wait at least a second, intervals fire at most once a second and
+ * animation frames come once a second. Intervals are chains of timeouts, so
+ * a throttled one does not even wake up in between. Intervals and the frames
+ * asked for in the background get ids of their own, above those WebKit
+ * hands out, which the clear and cancel functions look up.
+ */
+static const char throttlescript[] =
+	"(function(w) {"
+	"var st = w.setTimeout, ct = w.clearTimeout, ci = w.clearInterval,"
+	" raf = w.requestAnimationFrame || w.webkitRequestAnimationFrame,"
+	" caf = w.cancelAnimationFrame || w.webkitCancelAnimationFrame,"
+	" n = 1e9, tm = {};"
+	"w.__surfbackground = %s;"
+	"function wait(t) {"
+	" return w.__surfbackground ? Math.max(t || 0, 1000) : t || 0;"
+	"}"
+	"function clear(c, id) {"
+	" if(!(id in tm)) return c.call(w, id);"
+	" ct.call(w, tm[id]);"
+	" delete tm[id];"
+	"}"
+	"w.setTimeout = function(f, t) {"
+	" var a = [].slice.call(arguments);"
+	" if(w.__surfbackground) a[1] = wait(t);"
+	" return st.apply(w, a);"
+	"};"
+	"w.setInterval = function(f, t) {"
+	" var id = ++n, a = [].slice.call(arguments, 2);"
+	" if(typeof f != 'function') f = new Function(f);"
+	" function tick() {"
+	"  tm[id] = st.call(w, tick, wait(t));"
+	"  f.apply(w, a);"
+	" }"
+	" tm[id] = st.call(w, tick, wait(t));"
+	" return id;"
+	"};"
+	"w.clearTimeout = function(id) { clear(ct, id); };"
+	"w.clearInterval = function(id) { clear(ci, id); };"
+	"if(raf) w.requestAnimationFrame = w.webkitRequestAnimationFrame ="
+	" function(f) {"
+	"  var id = ++n;"
+	"  if(!w.__surfbackground) return raf.call(w, f);"
+	"  tm[id] = st.call(w, function() { delete tm[id]; f(Date.now()); },"
+	"   1000);"
+	"  return id;"
+	" };"
+	"if(caf) w.cancelAnimationFrame = w.webkitCancelAnimationFrame ="
+	" function(id) { clear(caf, id); };"
+	"})(window);";
+
+/* switches the page in and out of the background, pausing CSS animations */
+static const char backgroundscript[] =
+	"(function(d, on) {"
+	"var s = d.getElementById('surf-background');"
+	"window.__surfbackground = on;"
+	"if(on && !s && d.documentElement) {"
+	" s = d.createElement('style');"
+	" s.id = 'surf-background';"
+	" s.textContent = '*, *:before, *:after {"
+	" -webkit-animation-play-state: paused !important;"
+	" animation-play-state: paused !important; }';"
+	" d.documentElement.appendChild(s);"
+	"} else if(!on && s) {"
+	" s.parentNode.removeChild(s);"
+	"}"
+	"})(document, %s);";
 static gboolean hasloaded = false;
 static gboolean hasvisual = false;
+static gboolean zygote = FALSE;
+static gboolean zygotechild = FALSE;
+static gboolean sessionrestoring = FALSE;
+static char *sessionentry = NULL;
+static char *sessiondir = NULL;
+static gdouble restorey = -1;
+static gdouble restorezoom = -1;
+static char *restoretoggles = NULL;	/* of the window, see sessionload() */
+static gboolean quitting = FALSE;
+static GSList *placeholders = NULL;
+static gint64 spawntime = 0;
+static char *brokerpath = NULL;
+static FILE *tracefp = NULL;
+static ino_t brokerino = 0;
 
 static void acceptlanguagescramble();
 static void addaccelgroup(Client *c);
+static void background(Client *c, gboolean on);
+static void backgroundprocess(gboolean on);
+static gboolean atomflush(Client *c);
+static void benchmicro(void);
 static void beforerequest(WebKitWebView *w, WebKitWebFrame *f,
 		WebKitWebResource *r, WebKitNetworkRequest *req,
 		WebKitNetworkResponse *resp, Client *c);
+static gboolean blockcompile(const char *src, const char *dst,
+		const struct stat *st);
+static guint32 blockanchor(guint32 w);
+static gboolean blockcheck(const BlockIndex *h, size_t size);
+static guint32 blockhash(const char *s, size_t n);
+static void blockload(void);
+static gboolean blockmatch(const char *uri);
+static gboolean brokeraccept(GIOChannel *ch, GIOCondition cond, gpointer d);
+static void brokerhandle(char **argv);
+static void brokerlisten(const char *origin);
+static gboolean brokeropen(const char *uri, char *const *cmd);
+static gboolean brokerread(GIOChannel *ch, GIOCondition cond, GString *msg);
 static char *buildpath(const char *path);
+static gboolean cachebudget(gpointer unused);
+static gboolean cacheflush(gpointer unused);
+static gpointer cacheload(gpointer unused);
+static void cachewait(void);
+static void cachegotchunk(SoupMessage *msg, SoupBuffer *chunk, gpointer d);
+static void cacherequest(SoupSession *s, SoupMessage *msg, SoupSocket *sock,
+		gpointer d);
+static int cacheusecmp(gconstpointer a, gconstpointer b);
+static guint cacheuses(const char *origin);
+static void contentlength(WebKitWebView *v, WebKitWebFrame *f,
+		WebKitWebResource *r, gint length, Client *c);
+static gboolean controlaccept(GIOChannel *ch, GIOCondition cond, Client *c);
+static void controlclose(Control *ctl);
+static void controldrain(Client *c);
+static void controlcommand(Client *c, char *line, GString *out);
+static void controllisten(Client *c);
+static gboolean controlread(GIOChannel *ch, GIOCondition cond,
+		Control *ctl);
+static gboolean controlwrite(GIOChannel *ch, GIOCondition cond,
+		Control *ctl);
+static gint64 cputime(void);
+static char *expandpath(const char *path);
 static gboolean buttonrelease(WebKitWebView *web, GdkEventButton *e, Client *c);
 static void cleanup(void);
 static void clipboard(Client *c, const Arg *arg);
@@ -126,12 +443,18 @@ static void clipboard(Client *c, const Arg *arg);
 /* Cookiejar implementation */
 static void cookiejar_changed(SoupCookieJar *self, SoupCookie *old_cookie,
 		SoupCookie *new_cookie);
+static void cookiejar_compact(CookieJar *j);
 static void cookiejar_finalize(GObject *self);
+static char *cookiejar_format(SoupCookie *c);
+static char *cookiejar_key(SoupCookie *c);
+static void cookiejar_load(CookieJar *j, const char *filename);
+static void cookiejar_reload(CookieJar *j);
+static void cookiejar_replay(CookieJar *j, gboolean others);
+static void cookiejar_log(CookieJar *j, const char *line);
 static SoupCookieJarAcceptPolicy cookiepolicy_get(void);
 static SoupCookieJar *cookiejar_new(const char *filename, gboolean read_only,
 		SoupCookieJarAcceptPolicy policy);
-static void cookiejar_set_property(GObject *self, guint prop_id,
-		const GValue *value, GParamSpec *pspec);
+static SoupCookie *cookiejar_parse(char *line);
 static char cookiepolicy_set(const SoupCookieJarAcceptPolicy p);
 
 static char *copystr(char **str, const char *src);
@@ -149,9 +472,16 @@ static gboolean decidewindow(WebKitWebView *v, WebKitWebFrame *f,
 static gboolean deletion_interface(WebKitWebView *view,
 		WebKitDOMHTMLElement *arg1, Client *c);
 static void destroyclient(Client *c);
+static gboolean discard(Client *c);
+static void discardcollect(Client *c);
+static gboolean destroyidle(Client *c);
 static void destroywin(GtkWidget* w, Client *c);
 static void die(const char *errstr, ...);
+static void dirempty(const char *path);
+static guint64 dirsize(const char *path);
 static void eval(Client *c, const Arg *arg);
+static void evalscript(JSContextRef js, char *script, char* scriptname);
+static char *evalstring(JSContextRef js, const char *script);
 static void find(Client *c, const Arg *arg);
 static void fullscreen(Client *c, const Arg *arg);
 static void geopolicyrequested(WebKitWebView *v, WebKitWebFrame *f,
@@ -160,10 +490,38 @@ static const char *getatom(Client *c, int a);
 static void gettogglestat(Client *c);
 static void getpagestat(Client *c);
 static char *geturi(Client *c);
-static gchar *getstyle(const char *uri);
+static const char *getstyle(const char *uri);
 
 static void handleplumb(Client *c, WebKitWebView *w, const gchar *uri);
 
+static void harchunk(SoupMessage *msg, SoupBuffer *chunk, HarEntry *e);
+static void harentryfree(gpointer data);
+static void harfinished(SoupMessage *msg, HarEntry *e);
+static void harfree(Har *har);
+static void harheaders(SoupMessage *msg, HarEntry *e);
+static void harnetwork(SoupMessage *msg, GSocketClientEvent event,
+		GIOStream *connection, HarEntry *e);
+static void harputs(FILE *f, const char *s);
+static void harqueued(SoupSession *s, SoupMessage *msg, gpointer d);
+static void harrequest(Har *har, WebKitNetworkRequest *req);
+static void harstart(Client *c);
+static void harwrite(Client *c);
+static void harwrote(SoupMessage *msg, HarEntry *e);
+
+static gboolean downloadasked(GIOChannel *ch, GIOCondition cond,
+		Download *d);
+static void downloadbegin(Download *d, const char *dir, const char *name);
+static void downloadchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s);
+static void downloaddone(Download *d);
+static void downloadfinished(SoupSession *session, SoupMessage *msg,
+		gpointer data);
+static void downloadflush(Segment *s);
+static void downloadheaders(SoupMessage *msg, Segment *s);
+static void downloadrestart(Download *d, Segment *s);
+static gboolean downloadresume(Download *d);
+static void downloadsave(Download *d);
+static void downloadstart(Segment *s);
+static char *downloadvalidator(SoupMessage *msg);
 static gboolean initdownload(WebKitWebView *v, WebKitDownload *o, Client *c);
 
 static void inspector(Client *c, const Arg *arg);
@@ -181,10 +539,14 @@ static void linkhover(WebKitWebView *v, const char* t, const char* l,
 static void loadstatuschange(WebKitWebView *view, GParamSpec *pspec,
 		Client *c);
 static void loaduri(Client *c, const Arg *arg, gboolean explicitnavigation);
+static void metricswrite(Client *c);
 static void navigate(Client *c, const Arg *arg);
 static Client *newclient(void);
+static void openuri(Client *c, const char *uri, const char *referrer);
 static void newwindow(Client *c, const Arg *arg, gboolean noembed, gboolean explicitnavigation);
+static char *parseargs(int argc, char *argv[]);
 static int origincmp(const char *uri1, const char *uri2);
+static const Origin *originget(const char *uri);
 static int originhas(const char *uri);
 static const char *origingetproto(const char *uri);
 static char *origingetfolder(const char *uri);
@@ -192,6 +554,7 @@ static char *origingethost(const char *uri);
 static char *origingeturi(const char *uri);
 static int originmatch(const char *uri1, const char *uri2);
 static void pasteuri(GtkClipboard *clipboard, const char *text, gpointer d);
+static void printstats(void);
 static gboolean contextmenu(WebKitWebView *view, GtkWidget *menu,
 		WebKitHitTestResult *target, gboolean keyboard, Client *c);
 static void menuactivate(GtkMenuItem *item, Client *c);
@@ -202,13 +565,40 @@ static void progresschange(WebKitWebView *view, GParamSpec *pspec, Client *c);
 static void linkopen(Client *c, const Arg *arg);
 static void linkopenembed(Client *c, const Arg *arg);
 static void reload(Client *c, const Arg *arg);
+static void scriptchanged(GFileMonitor *m, GFile *f, GFile *other,
+		GFileMonitorEvent event, Script *s);
+static gboolean scriptcompile(SiteScript *s);
+static char *scriptget(Script *s);
+static Script *scriptnew(const char *path);
 static void scroll_h(Client *c, const Arg *arg);
 static void scroll_v(Client *c, const Arg *arg);
 static void scroll(GtkAdjustment *a, const Arg *arg);
+static int sessionentrycmp(gconstpointer a, gconstpointer b);
+static gboolean sessionfocus(GtkWidget *w, GdkEventFocus *e, Client *c);
+static void sessionforget(Client *c);
+static char *sessionload(const char *path);
+static char *sessionpath(Client *c);
+static gboolean sessionplaceholderfocus(GtkWidget *w, GdkEventFocus *e,
+		gpointer d);
+static void sessionplaceholdergone(GtkWidget *w, gpointer d);
+static void sessionrestore(void);
+static gboolean sessionrestorenext(gpointer d);
+static void sessionsave(Client *c);
+static void sessionspawn(const char *path);
+static gboolean sessionterm(gpointer d);
 static void setatom(Client *c, int a, const char *v);
+static void setstyle(Client *c, const char *style);
 static void setup(const char *uri_arg);
+static void setupshared(void);
 static void sigchld(int unused);
+static int sockconnect(const char *path);
+static char *sockgetargv(int fd, char ***env, char ***argv);
+static char *sockparseargv(GString *msg, char ***env, char ***argv);
+static int socklisten(const char *path);
+static gboolean sockputargv(const char *path, char *const *env,
+		char *const *argv);
 static void source(Client *c, const Arg *arg);
+static long rsskb(void);
 static void spawn(Client *c, const Arg *arg);
 static gchar *strentropy();
 static gchar *strlangentropy();
@@ -216,19 +606,32 @@ static int strrand(char *buf, int buflen);
 static void stop(Client *c, const Arg *arg);
 static void useragentscramble(WebKitWebView *view);
 static void titlechange(WebKitWebView *view, GParamSpec *pspec, Client *c);
+static gpointer tlsload(gpointer unused);
+static void tlswait(void);
 static void titlechangeleave(void *a, void *b, Client *c);
+static gboolean titleflush(Client *c);
+static void trace(const char *name, char phase);
+static void traceinit(void);
 static void toggle(Client *c, const Arg *arg);
 static void togglecookiepolicy(Client *c, const Arg *arg);
 static void togglegeolocation(Client *c, const Arg *arg);
 static void togglescrollbars(Client *c, const Arg *arg);
+static gboolean stylecompile(SiteStyle *s);
 static void togglestyle(Client *c, const Arg *arg);
+static void undiscard(Client *c);
+static void updatestat(Client *c);
 static void updatetitle(Client *c);
+static int uriclassify(const char *uri);
 static void updatewinid(Client *c);
 static void usage(void);
 char *qualify_uri(const char *uri);
 static void windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame,
 		JSContextRef js, JSObjectRef win, Client *c);
 static void zoom(Client *c, const Arg *arg);
+static gboolean visibilitychange(GtkWidget *w, GdkEvent *e, Client *c);
+static gboolean zygotespawn(char *const *cmd);
+static guint zygotethreads(void);
+static char **zygotewait(void);
 
 /* configuration, allows nested code to access above variables */
 #include "config.h"
@@ -247,262 +650,1638 @@ addaccelgroup(Client *c) {
 	gtk_window_add_accel_group(GTK_WINDOW(c->win), group);
 }
 
+/* c went out of sight, or came back */
 static void
-beforerequest(WebKitWebView *w, WebKitWebFrame *f, WebKitWebResource *r,
-		WebKitNetworkRequest *req, WebKitNetworkResponse *resp,
-		Client *c) {
-	const gchar *uri = webkit_network_request_get_uri(req);
-	int i, isascii = 1;
-
-	if(g_str_has_suffix(uri, "/favicon.ico"))
-		webkit_network_request_set_uri(req, "about:blank");
+background(Client *c, gboolean on) {
+	WebKitWebFrame *frame = webkit_web_view_get_main_frame(c->view);
+	JSGlobalContextRef js = webkit_web_frame_get_global_context(frame);
+	char *script;
+	Client *p;
+	gboolean all = TRUE;
 
-	if(!g_str_has_prefix(uri, "http://") \
-			&& !g_str_has_prefix(uri, "https://") \
-			&& !g_str_has_prefix(uri, "about:") \
-			&& !g_str_has_prefix(uri, "file://") \
-			&& !g_str_has_prefix(uri, "data:") \
-			&& !g_str_has_prefix(uri, "blob:") \
-			&& strlen(uri) > 0) {
-
-		for(i = 0; i < strlen(uri); i++) {
-			if(!g_ascii_isprint(uri[i])) {
-				isascii = 0;
-				break;
-			}
-		}
-		if(isascii)
-			handleplumb(c, w, uri);
+	if(!backgroundthrottle)
+		return;
+	if(c->background != on) {
+		c->background = on;
+		trace(on ? "background" : "foreground", 'i');
+		script = g_strdup_printf(backgroundscript,
+				on ? "true" : "false");
+		evalscript(js, script, "");
+		g_free(script);
+		if(on)
+			JSGarbageCollect(js);
 	}
+
+	/* windows opened meanwhile count as being in the foreground */
+	for(p = clients; p; p = p->next)
+		all = all && p->background;
+	backgroundprocess(all);
 }
 
-static char *
-buildpath(const char *path) {
-	char *apath, *p;
-	FILE *f;
+/*
+ * With all windows in the background, the CPU time of the process is
+ * accounted for. The connections of the session are left alone, downloads
+ * in the background need them as much as ever.
+ */
+static void
+backgroundprocess(gboolean on) {
+	if(on == (bgstats.since != 0))
+		return;
 
-	/* creating directory */
-	if(path[0] == '/') {
-		apath = g_strdup(path);
-	} else if(path[0] == '~') {
-		if(path[1] == '/') {
-			apath = g_strconcat(g_get_home_dir(), &path[1], NULL);
-		} else {
-			apath = g_strconcat(g_get_home_dir(), "/",
-					&path[1], NULL);
-		}
+	if(on) {
+		bgstats.since = g_get_monotonic_time();
+		bgstats.cpu -= cputime();
 	} else {
-		apath = g_strconcat(g_get_current_dir(), "/", path, NULL);
+		bgstats.wall += g_get_monotonic_time() - bgstats.since;
+		bgstats.since = 0;
+		bgstats.cpu += cputime();
 	}
+}
 
-	if((p = strrchr(apath, '/'))) {
-		*p = '\0';
-		g_mkdir_with_parents(apath, 0700);
-		g_chmod(apath, 0700); /* in case it existed */
-		*p = '/';
-	}
-	/* creating file (gives error when apath ends with "/") */
-	if((f = fopen(apath, "a"))) {
-		g_chmod(apath, 0600); /* always */
-		fclose(f);
-	}
+/* the CPU time of the process so far, in us */
+static gint64
+cputime(void) {
+	struct rusage ru;
 
-	return apath;
+	getrusage(RUSAGE_SELF, &ru);
+	return (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+		* G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
 }
 
 static gboolean
-buttonrelease(WebKitWebView *web, GdkEventButton *e, Client *c) {
-	WebKitHitTestResultContext context;
-	WebKitHitTestResult *result = webkit_web_view_get_hit_test_result(web,
-			e);
-	Arg arg;
-	unsigned int i;
-
-	g_object_get(result, "context", &context, NULL);
-	g_object_get(result, "link-uri", &arg.v, NULL);
-	for(i = 0; i < LENGTH(buttons); i++) {
-		if(context & buttons[i].click && e->button == buttons[i].button &&
-		CLEANMASK(e->state) == CLEANMASK(buttons[i].mask) && buttons[i].func) {
-			buttons[i].func(c, buttons[i].click == ClkLink && buttons[i].arg.i == 0 ? &arg : &buttons[i].arg);
-			return true;
-		}
+atomflush(Client *c) {
+	Window win = GDK_WINDOW_XID(GTK_WIDGET(c->win)->window);
+	int a;
+
+	c->atomid = 0;
+	for(a = 0; a < AtomLast; a++) {
+		if(!(c->atomdirty & 1 << a))
+			continue;
+		XChangeProperty(dpy, win, atoms[a], XA_STRING, 8,
+				PropModeReplace, (unsigned char *)c->atomval[a],
+				strlen(c->atomval[a]) + 1);
+		c->atomechoes[a]++;
+		xstats.writes++;
 	}
-	return false;
-}
+	c->atomdirty = 0;
+	XFlush(dpy);
+	xstats.flushes++;
 
-static void
-cleanup(void) {
-	if(diskcache) {
-		soup_cache_flush(diskcache);
-		soup_cache_dump(diskcache);
-	}
-	while(clients)
-		destroyclient(clients);
-	g_free(cookiefile);
-	g_free(scriptfile);
-	g_free(stylefile);
+	return FALSE;
 }
 
 static void
-cookiejar_changed(SoupCookieJar *self, SoupCookie *old_cookie,
-		SoupCookie *new_cookie) {
-	flock(COOKIEJAR(self)->lock, LOCK_EX);
-	if(new_cookie && !new_cookie->expires && sessiontime) {
-		soup_cookie_set_expires(new_cookie,
-				soup_date_new_from_now(sessiontime));
+beforerequest(WebKitWebView *w, WebKitWebFrame *f, WebKitWebResource *r,
+		WebKitNetworkRequest *req, WebKitNetworkResponse *resp,
+		Client *c) {
+	const gchar *uri = webkit_network_request_get_uri(req);
+	int kind = uriclassify(uri);
+
+	if(tlsthread && kind & UriHttps)
+		tlswait();
+	if(cachethread && kind & UriWeb)
+		cachewait();
+
+	if(kind & UriFavicon || (blockindex && kind & UriWeb
+				&& blockmatch(uri))) {
+		webkit_network_request_set_uri(req, "about:blank");
+	} else if(!(kind & UriWeb) && kind & UriPrint) {
+		handleplumb(c, w, uri);
+	} else if(kind & UriHttps || g_str_has_prefix(uri, "http://")) {
+		/* only these can be answered by the cache or the network */
+		cachestats.requests++;
+		if(c->load.start)
+			c->load.requests++;
+		if(c->har)
+			harrequest(c->har, req);
 	}
-	SOUP_COOKIE_JAR_CLASS(cookiejar_parent_class)->changed(self,
-			old_cookie, new_cookie);
-	flock(COOKIEJAR(self)->lock, LOCK_UN);
 }
 
-static void
-cookiejar_class_init(CookieJarClass *klass) {
-	SOUP_COOKIE_JAR_CLASS(klass)->changed = cookiejar_changed;
-	G_OBJECT_CLASS(klass)->get_property =
-		G_OBJECT_CLASS(cookiejar_parent_class)->get_property;
-	G_OBJECT_CLASS(klass)->set_property = cookiejar_set_property;
-	G_OBJECT_CLASS(klass)->finalize = cookiejar_finalize;
-	g_object_class_override_property(G_OBJECT_CLASS(klass), 1, "filename");
-}
+/* a surf of another window connects, brokerread() takes what it sends */
+static gboolean
+brokeraccept(GIOChannel *ch, GIOCondition cond, gpointer d) {
+	GIOChannel *cch;
+	int fd;
 
-static void
-cookiejar_finalize(GObject *self) {
-	close(COOKIEJAR(self)->lock);
-	G_OBJECT_CLASS(cookiejar_parent_class)->finalize(self);
-}
+	if((fd = accept(g_io_channel_unix_get_fd(ch), NULL, NULL)) == -1)
+		return TRUE;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-static void
-cookiejar_init(CookieJar *self) {
-	self->lock = open(cookiefile, 0);
-}
+	cch = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(cch, TRUE);
+	g_io_add_watch_full(cch, G_PRIORITY_DEFAULT,
+			G_IO_IN | G_IO_HUP | G_IO_ERR, (GIOFunc)brokerread,
+			g_string_new(NULL), NULL);
+	g_io_channel_unref(cch);
 
-static SoupCookieJar *
-cookiejar_new(const char *filename, gboolean read_only,
-		SoupCookieJarAcceptPolicy policy) {
-	return g_object_new(COOKIEJAR_TYPE,
-	                    SOUP_COOKIE_JAR_TEXT_FILENAME, filename,
-	                    SOUP_COOKIE_JAR_READ_ONLY, read_only,
-			    SOUP_COOKIE_JAR_ACCEPT_POLICY, policy, NULL);
+	return TRUE;
 }
 
+/* opens the uri of the surf command line argv in a window of ours */
 static void
-cookiejar_set_property(GObject *self, guint prop_id, const GValue *value,
-		GParamSpec *pspec) {
-	flock(COOKIEJAR(self)->lock, LOCK_SH);
-	G_OBJECT_CLASS(cookiejar_parent_class)->set_property(self, prop_id,
-			value, pspec);
-	flock(COOKIEJAR(self)->lock, LOCK_UN);
-}
+brokerhandle(char **argv) {
+	char *uri = NULL, *referrer = NULL;
+	GdkNativeWindow oldembed = embed;
+	gboolean images = TRUE, scripts = TRUE, plugins = TRUE;
+	gboolean scrollbars = TRUE;
+	Client *c;
+	Arg arg;
+	int i;
 
-static SoupCookieJarAcceptPolicy
-cookiepolicy_get(void) {
-	switch(cookiepolicies[policysel]) {
-	case 'a':
-		return SOUP_COOKIE_JAR_ACCEPT_NEVER;
-	case '@':
-		return SOUP_COOKIE_JAR_ACCEPT_NO_THIRD_PARTY;
-	case 'A':
-	default:
-		break;
+	embed = 0;
+	for(i = 1; argv[i]; i++) {
+		if(!strcmp(argv[i], "--")) {
+			uri = argv[i + 1];
+			break;
+		} else if(!strcmp(argv[i], "-e") && argv[i + 1]) {
+			embed = strtol(argv[++i], NULL, 0);
+		} else if(!strcmp(argv[i], "-R") && argv[i + 1]) {
+			referrer = argv[++i];
+		} else if((!strcmp(argv[i], "-a") || !strcmp(argv[i], "-c"))
+				&& argv[i + 1]) {
+			i++;
+		} else if(!strcmp(argv[i], "-b")) {
+			scrollbars = FALSE;
+		} else if(!strcmp(argv[i], "-i")) {
+			images = FALSE;
+		} else if(!strcmp(argv[i], "-p")) {
+			plugins = FALSE;
+		} else if(!strcmp(argv[i], "-s")) {
+			scripts = FALSE;
+		}
 	}
-
-	return SOUP_COOKIE_JAR_ACCEPT_ALWAYS;
+	if(uri && origin_uri && originmatch(uri, origin_uri)) {
+		c = newclient();
+		updatewinid(c);
+		/* the toggles of the window asking, not of ours */
+		g_object_set(G_OBJECT(webkit_web_view_get_settings(c->view)),
+				"auto-load-images", images,
+				"enable-scripts", scripts,
+				"enable-plugins", plugins, NULL);
+		if(!scrollbars) {
+			gtk_scrolled_window_set_policy(
+					GTK_SCROLLED_WINDOW(c->scroll),
+					GTK_POLICY_NEVER, GTK_POLICY_NEVER);
+		}
+		openuri(c, uri, referrer);
+	} else if(argv[0]) {
+		/* not ours after all, start the process it asked for */
+		arg.v = argv;
+		spawn(NULL, &arg);
+	}
+	embed = oldembed;
 }
 
-static char
-cookiepolicy_set(const SoupCookieJarAcceptPolicy ep) {
-	switch(ep) {
-	case SOUP_COOKIE_JAR_ACCEPT_NEVER:
-		return 'a';
-	case SOUP_COOKIE_JAR_ACCEPT_NO_THIRD_PARTY:
-		return '@';
-	case SOUP_COOKIE_JAR_ACCEPT_ALWAYS:
-	default:
-		break;
+/*
+ * Collects the message of a broker connection without ever blocking, and
+ * handles it once the sender closed the connection.
+ */
+static gboolean
+brokerread(GIOChannel *ch, GIOCondition cond, GString *msg) {
+	char buf[BUFSIZ], *m, **env, **argv;
+	ssize_t n;
+
+	if((n = read(g_io_channel_unix_get_fd(ch), buf, sizeof(buf))) > 0) {
+		g_string_append_len(msg, buf, n);
+		return TRUE;
 	}
+	if(n == -1 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
 
-	return 'A';
+	if(n == 0 && (m = sockparseargv(msg, &env, &argv))) {
+		brokerhandle(argv);
+		g_free(env);
+		g_free(argv);
+		g_free(m);
+	} else {
+		g_string_free(msg, TRUE);
+	}
+	return FALSE;
 }
 
+/* makes this process the one other windows hand uris of our origin to */
 static void
-evalscript(JSContextRef js, char *script, char* scriptname) {
-	JSStringRef jsscript, jsscriptname;
-	JSValueRef exception = NULL;
-
-	jsscript = JSStringCreateWithUTF8CString(script);
-	jsscriptname = JSStringCreateWithUTF8CString(scriptname);
-	JSEvaluateScript(js, jsscript, JSContextGetGlobalObject(js),
-			jsscriptname, 0, &exception);
-	JSStringRelease(jsscript);
-	JSStringRelease(jsscriptname);
-}
+brokerlisten(const char *origin) {
+	char *originpath;
+	struct stat st;
+	int fd;
 
-static void
-runscript(WebKitWebFrame *frame) {
-	char *script;
-	GError *error;
+	originpath = g_strdup_printf(originsocket, origin);
+	brokerpath = buildpath(originpath);
+	g_free(originpath);
 
-	if(g_file_get_contents(scriptfile, &script, NULL, &error)) {
-		evalscript(webkit_web_frame_get_global_context(frame),
-				script, scriptfile);
+	if((fd = socklisten(brokerpath)) == -1 || stat(brokerpath, &st)) {
+		g_free(brokerpath);
+		brokerpath = NULL;
+		return;
 	}
+	brokerino = st.st_ino;
+	g_io_add_watch(g_io_channel_unix_new(fd), G_IO_IN, brokeraccept, NULL);
 }
 
-static void
-clipboard(Client *c, const Arg *arg) {
-	gboolean paste = *(gboolean *)arg;
+/*
+ * Hands cmd over to the surf which already owns the origin of uri. Returns
+ * FALSE when there is none, or it is us, and the caller has to start one.
+ */
+static gboolean
+brokeropen(const char *uri, char *const *cmd) {
+	char *origin, *originpath, *path;
+	gboolean sent;
 
-	if(paste) {
-		gtk_clipboard_request_text(
-				gtk_clipboard_get(GDK_SELECTION_PRIMARY),
-				pasteuri, c);
+	if(!sameoriginpolicy || !uri || !(origin = origingetfolder(uri)))
+		return FALSE;
+
+	originpath = g_strdup_printf(originsocket, origin);
+	path = expandpath(originpath);
+	if(brokerpath && !strcmp(path, brokerpath)) {
+		/* ours; unless newwindow() is about to exit, open it here */
+		if((sent = hasvisual))
+			brokerhandle((char **)cmd);
 	} else {
-		gtk_clipboard_set_text(
-				gtk_clipboard_get(GDK_SELECTION_PRIMARY),
-				c->linkhover ? c->linkhover : geturi(c), -1);
+		sent = sockputargv(path, NULL, cmd);
 	}
+	g_free(path);
+	g_free(originpath);
+	g_free(origin);
+
+	return sent;
 }
 
-static char *
-copystr(char **str, const char *src) {
-	char *tmp;
-	tmp = g_strdup(src);
+#define BLOCKMAGIC  "surfblk2"
+#define BLOCKANCHOR 4	/* the characters of a guint32 */
+#define BLOCKWORD(s) ((guchar)(s)[0] | (guchar)(s)[1] << 8 \
+		| (guchar)(s)[2] << 16 | (guint32)(guchar)(s)[3] << 24)
 
-	if(str && *str) {
-		g_free(*str);
-		*str = tmp;
+/*
+ * Compiles the EasyList style rules in src into the index dst. Supported are
+ * ||host^ rules, and plain substring rules, possibly anchored with | or ending
+ * in ^. Exceptions, element hiding, wildcards in the middle of a rule and
+ * rules with $options are skipped.
+ */
+static gboolean
+blockcompile(const char *src, const char *dst, const struct stat *st) {
+	BlockIndex h;
+	GPtrArray *hosts, *pats;
+	GString *pool;
+	guint32 *table, *buckets, *list, *fill, slot;
+	char *contents, *line, *next, *r, *end, *tmp;
+	size_t n;
+	guint i;
+	FILE *f;
+	gboolean ok = FALSE;
+
+	if(!g_file_get_contents(src, &contents, NULL, NULL))
+		return FALSE;
+
+	hosts = g_ptr_array_new();
+	pats = g_ptr_array_new();
+	for(line = contents; line && *line; line = next) {
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+		g_strstrip(line);
+		if(!*line || line[0] == '!' || line[0] == '['
+				|| g_str_has_prefix(line, "@@")
+				|| strchr(line, '$') || strchr(line, '#'))
+			continue;
+		for(r = line; *r; r++)
+			*r = g_ascii_tolower(*r);
+
+		if(g_str_has_prefix(line, "||")) {
+			r = line + 2;
+			n = strspn(r, "abcdefghijklmnopqrstuvwxyz0123456789.-");
+			if(n > 0 && (r[n] == '\0' || (r[n] == '^'
+							&& r[n + 1] == '\0'))) {
+				r[n] = '\0';
+				g_ptr_array_add(hosts, r);
+				continue;
+			}
+		} else {
+			r = line + (line[0] == '|');
+		}
+
+		while(*r == '*')
+			r++;
+		end = r + strlen(r);
+		while(end > r && (end[-1] == '*' || end[-1] == '^'
+					|| end[-1] == '|'))
+			*--end = '\0';
+		if(end - r >= BLOCKANCHOR && !strpbrk(r, "*^|"))
+			g_ptr_array_add(pats, r);
 	}
-	return tmp;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BLOCKMAGIC, sizeof(h.magic));
+	h.srcmtime = st->st_mtime;
+	h.srcsize = st->st_size;
+	for(h.nhosts = 16; h.nhosts < hosts->len * 2; h.nhosts <<= 1);
+	for(h.npats = 16; h.npats < pats->len; h.npats <<= 1);
+	h.hosts = sizeof(h);
+	h.buckets = h.hosts + h.nhosts * sizeof(guint32);
+	h.patterns = h.buckets + (h.npats + 1) * sizeof(guint32);
+	h.strings = h.patterns + pats->len * sizeof(guint32);
+
+	pool = g_string_new(NULL);
+	g_string_append_c(pool, '\0');
+
+	table = g_new0(guint32, h.nhosts);
+	for(i = 0; i < hosts->len; i++) {
+		r = g_ptr_array_index(hosts, i);
+		slot = blockhash(r, strlen(r)) & (h.nhosts - 1);
+		while(table[slot] && strcmp(pool->str + table[slot], r))
+			slot = (slot + 1) & (h.nhosts - 1);
+		if(!table[slot]) {
+			table[slot] = pool->len;
+			g_string_append_len(pool, r, strlen(r) + 1);
+		}
+	}
+
+	buckets = g_new0(guint32, h.npats + 1);
+	fill = g_new0(guint32, h.npats);
+	list = g_new0(guint32, pats->len + 1);
+	for(i = 0; i < pats->len; i++) {
+		r = g_ptr_array_index(pats, i);
+		buckets[(blockanchor(BLOCKWORD(r)) & (h.npats - 1)) + 1]++;
+	}
+	for(i = 0; i < h.npats; i++)
+		buckets[i + 1] += buckets[i];
+	for(i = 0; i < pats->len; i++) {
+		r = g_ptr_array_index(pats, i);
+		slot = blockanchor(BLOCKWORD(r)) & (h.npats - 1);
+		list[buckets[slot] + fill[slot]++] = pool->len;
+		g_string_append_len(pool, r, strlen(r) + 1);
+	}
+
+	tmp = g_strdup_printf("%s.%d", dst, (int)getpid());
+	if((f = fopen(tmp, "w"))) {
+		ok = fwrite(&h, sizeof(h), 1, f) == 1
+			&& fwrite(table, sizeof(guint32), h.nhosts, f)
+				== h.nhosts
+			&& fwrite(buckets, sizeof(guint32), h.npats + 1, f)
+				== h.npats + 1
+			&& fwrite(list, sizeof(guint32), pats->len, f)
+				== pats->len
+			&& fwrite(pool->str, 1, pool->len, f) == pool->len;
+		ok = fclose(f) == 0 && ok && rename(tmp, dst) == 0;
+		if(!ok)
+			g_unlink(tmp);
+	}
+
+	g_free(tmp);
+	g_free(table);
+	g_free(buckets);
+	g_free(fill);
+	g_free(list);
+	g_string_free(pool, TRUE);
+	g_ptr_array_free(hosts, TRUE);
+	g_ptr_array_free(pats, TRUE);
+	g_free(contents);
+
+	return ok;
 }
 
-static WebKitWebView *
-createwindow(WebKitWebView  *v, WebKitWebFrame *f, Client *c) {
-	Client *n = newclient();
-	return n->view;
+/*
+ * Hashes the BLOCKANCHOR characters packed into w. blockmatch() slides w
+ * along the uri a character at a time, so this is one multiplication per
+ * position instead of a hash of the characters over and over.
+ */
+static guint32
+blockanchor(guint32 w) {
+	w *= 2654435761u;
+	return w ^ w >> 16;
 }
 
-static gboolean
-decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r,
-		gchar *m,  WebKitWebPolicyDecision *p, Client *c) {
-	if(!webkit_web_view_can_show_mime_type(v, m) && !webkit_web_frame_get_parent(f)) {
-		webkit_web_policy_decision_download(p);
-		return TRUE;
+/* FNV-1a */
+static guint32
+blockhash(const char *s, size_t n) {
+	guint32 h = 2166136261u;
+
+	while(n--) {
+		h ^= (guchar)*s++;
+		h *= 16777619u;
 	}
-	return FALSE;
+	return h;
 }
 
+/*
+ * Tells whether the index h, size bytes long, is one blockmatch() can use
+ * without reading past its end or looping forever, whatever is in the file.
+ * The caller has checked that it ends in a NUL.
+ */
 static gboolean
-decidenavigation(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r,
-		WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p,
-		Client *c) {
-	const char *uri = webkit_network_request_get_uri(r);
+blockcheck(const BlockIndex *h, size_t size) {
+	const guint32 *table, *buckets, *list;
+	guint64 strsize;
+	guint32 i, empty = 0;
+
+	if(h->nhosts == 0 || h->nhosts & (h->nhosts - 1) || h->npats == 0
+			|| h->npats & (h->npats - 1)
+			|| h->hosts % sizeof(guint32)
+			|| h->buckets % sizeof(guint32)
+			|| h->patterns % sizeof(guint32)
+			|| h->hosts < sizeof(*h)
+			|| h->hosts + (guint64)h->nhosts * sizeof(guint32)
+				> h->buckets
+			|| h->buckets + ((guint64)h->npats + 1) * sizeof(guint32)
+				> h->patterns
+			|| h->patterns > h->strings || h->strings >= size)
+		return FALSE;
+	table = (const guint32 *)((const char *)h + h->hosts);
+	buckets = (const guint32 *)((const char *)h + h->buckets);
+	list = (const guint32 *)((const char *)h + h->patterns);
+	strsize = size - h->strings;
+
+	/* an empty slot ends every probe */
+	for(i = 0; i < h->nhosts; i++) {
+		if(!table[i])
+			empty++;
+		else if(table[i] >= strsize)
+			return FALSE;
+	}
+	if(!empty)
+		return FALSE;
+
+	if(buckets[0] != 0 || h->patterns + (guint64)buckets[h->npats]
+			* sizeof(guint32) > h->strings)
+		return FALSE;
+	for(i = 0; i < h->npats; i++) {
+		if(buckets[i] > buckets[i + 1])
+			return FALSE;
+	}
+	for(i = 0; i < buckets[h->npats]; i++) {
+		if(list[i] >= strsize)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Maps the compiled block list, compiling it first if blockfile changed
+ * since. The mapping is shared read-only by all surf processes.
+ */
+static void
+blockload(void) {
+	char *src, *dst;
+	struct stat st, ist;
+	const BlockIndex *h;
+	void *map;
+	gboolean compiled = FALSE;
+	int fd;
+
+	/* not buildpath(), which would leave an empty list behind */
+	src = expandpath(blockfile);
+	dst = expandpath(blockindexfile);
+	if(stat(src, &st) || st.st_size == 0)
+		goto out;
+
+	for(;;) {
+		if((fd = open(dst, O_RDONLY | O_CLOEXEC)) != -1) {
+			map = MAP_FAILED;
+			if(!fstat(fd, &ist) && ist.st_size >= sizeof(BlockIndex)) {
+				map = mmap(NULL, ist.st_size, PROT_READ,
+						MAP_SHARED, fd, 0);
+			}
+			close(fd);
+			if(map != MAP_FAILED) {
+				h = map;
+				if(!memcmp(h->magic, BLOCKMAGIC, sizeof(h->magic))
+						&& h->srcmtime == st.st_mtime
+						&& h->srcsize == st.st_size
+						&& ((char *)map)[ist.st_size - 1]
+							== '\0'
+						&& blockcheck(h, ist.st_size)) {
+					blockindex = h;
+					blockindexsize = ist.st_size;
+					break;
+				}
+				munmap(map, ist.st_size);
+			}
+		}
+		/* stale or missing, compile it once and try again */
+		if(compiled || !blockcompile(src, dst, &st))
+			break;
+		compiled = TRUE;
+	}
+
+out:
+	g_free(src);
+	g_free(dst);
+}
+
+/* tells whether uri is blocked; surf-bench -m times it */
+static gboolean
+blockmatch(const char *uri) {
+	const guint32 *table, *buckets, *list;
+	const char *strings, *p;
+	char buf[2048];
+	size_t n, i;
+	guint32 slot, j, w;
+
+	if(!(p = strstr(uri, "://")))
+		return FALSE;
+
+	table = (const guint32 *)((const char *)blockindex + blockindex->hosts);
+	buckets = (const guint32 *)((const char *)blockindex
+			+ blockindex->buckets);
+	list = (const guint32 *)((const char *)blockindex
+			+ blockindex->patterns);
+	strings = (const char *)blockindex + blockindex->strings;
+
+	for(n = 0; uri[n] && n < sizeof(buf) - 1; n++)
+		buf[n] = g_ascii_tolower(uri[n]);
+	buf[n] = '\0';
+
+	/* the host and every domain it is in */
+	p = buf + (p - uri) + 3;
+	i = strcspn(p, "/?#");
+	if(memchr(p, '@', i))
+		p = (char *)memchr(p, '@', i) + 1;
+	i = strcspn(p, ":/?#");
+	while(i > 0) {
+		slot = blockhash(p, i) & (blockindex->nhosts - 1);
+		while(table[slot]) {
+			if(!strncmp(strings + table[slot], p, i)
+					&& strings[table[slot] + i] == '\0')
+				return TRUE;
+			slot = (slot + 1) & (blockindex->nhosts - 1);
+		}
+		for(; i > 0 && *p != '.'; p++, i--);
+		if(i > 0) {
+			p++;
+			i--;
+		}
+	}
+
+	/* substrings, found by their first few characters */
+	if(n < BLOCKANCHOR || buckets[blockindex->npats] == 0)
+		return FALSE;
+	w = BLOCKWORD(buf) << 8;
+	for(i = 0; i + BLOCKANCHOR <= n; i++) {
+		w = w >> 8 | (guint32)(guchar)buf[i + BLOCKANCHOR - 1] << 24;
+		slot = blockanchor(w) & (blockindex->npats - 1);
+		for(j = buckets[slot]; j < buckets[slot + 1]; j++) {
+			p = strings + list[j];
+			if(!strncmp(buf + i, p, strlen(p)))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static char *
+buildpath(const char *path) {
+	char *apath, *p;
+	FILE *f;
+
+	/* creating directory */
+	apath = expandpath(path);
+
+	if((p = strrchr(apath, '/'))) {
+		*p = '\0';
+		g_mkdir_with_parents(apath, 0700);
+		g_chmod(apath, 0700); /* in case it existed */
+		*p = '/';
+	}
+	/* creating file (gives error when apath ends with "/") */
+	if((f = fopen(apath, "a"))) {
+		g_chmod(apath, 0600); /* always */
+		fclose(f);
+	}
+
+	return apath;
+}
+
+/* needs to be g_free()'d by caller */
+static char *
+expandpath(const char *path) {
+	if(path[0] == '/') {
+		return g_strdup(path);
+	} else if(path[0] == '~') {
+		if(path[1] == '/') {
+			return g_strconcat(g_get_home_dir(), &path[1], NULL);
+		} else {
+			return g_strconcat(g_get_home_dir(), "/",
+					&path[1], NULL);
+		}
+	} else {
+		return g_strconcat(g_get_current_dir(), "/", path, NULL);
+	}
+}
+
+/*
+ * Keeps the caches of all origins together within diskcachebudget, by
+ * emptying the caches of the origins which have not been used for the longest
+ * time. Origins used within the last hour are left alone, their processes
+ * are likely still running.
+ */
+static gboolean
+cachebudget(gpointer unused) {
+	char *prefix, *suffix, *base, *path, *usage;
+	const char *name;
+	GDir *dir;
+	GArray *uses;
+	CacheUse u;
+	guint64 total = 0;
+	time_t now = time(NULL);
+	struct stat st;
+	FILE *f;
+	guint i;
+	int fd;
+
+	/* not while our own index is still being read, try again later */
+	if(cachethread)
+		return TRUE;
+
+	prefix = g_strdup(origincachefolder);
+	if(!(suffix = strstr(prefix, "%s"))) {
+		g_free(prefix);
+		return FALSE;
+	}
+	*suffix = '\0';
+	suffix += 2;
+	base = expandpath(prefix);
+
+	/* one scan every ten minutes is plenty, whichever process does it */
+	path = g_build_filename(base, ".budget", NULL);
+	if((!stat(path, &st) && now - st.st_mtime < 600)
+			|| !(dir = g_dir_open(base, 0, NULL))) {
+		g_free(path);
+		g_free(base);
+		g_free(prefix);
+		return FALSE;
+	}
+	if((f = fopen(path, "w")))
+		fclose(f);
+	g_free(path);
+
+	trace("cache_budget", 'B');
+	uses = g_array_new(FALSE, FALSE, sizeof(CacheUse));
+	while((name = g_dir_read_name(dir))) {
+		if(name[0] == '.')
+			continue;
+		u.dir = g_strconcat(base, name, suffix, NULL);
+		u.size = dirsize(u.dir);
+		usage = g_strdup_printf(originusagefile, name);
+		path = expandpath(usage);
+		u.used = stat(path, &st) ? 0 : st.st_mtime;
+		g_free(path);
+		g_free(usage);
+		/* a surf still running for the origin has its cache open */
+		usage = g_strdup_printf(originsocket, name);
+		path = expandpath(usage);
+		if((fd = sockconnect(path)) != -1) {
+			close(fd);
+			u.used = now;
+		}
+		g_free(path);
+		g_free(usage);
+		total += u.size;
+		g_array_append_val(uses, u);
+	}
+	g_dir_close(dir);
+
+	g_array_sort(uses, cacheusecmp);
+	for(i = 0; i < uses->len; i++) {
+		u = g_array_index(uses, CacheUse, i);
+		if(total > diskcachebudget && u.size && u.used < now - 3600) {
+			dirempty(u.dir);
+			total -= u.size;
+		}
+		g_free(u.dir);
+	}
+	g_array_free(uses, TRUE);
+	trace("cache_budget", 'E');
+
+	g_free(base);
+	g_free(prefix);
+	return FALSE;
+}
+
+/* writes what the disk cache collected since the last flush */
+static gboolean
+cacheflush(gpointer unused) {
+	/* dumping an index not loaded yet would lose all entries */
+	if(cachethread)
+		cachewait();
+	trace("soup_cache_dump", 'B');
+	soup_cache_flush(diskcache);
+	soup_cache_dump(diskcache);
+	trace("soup_cache_dump", 'E');
+	/* still in use, however long this process has been running */
+	if(usagepath)
+		g_utime(usagepath, NULL);
+	cacheflushid = 0;
+
+	return FALSE;
+}
+
+/* reads the index of the disk cache, on its own thread; see cachewait() */
+static gpointer
+cacheload(gpointer unused) {
+	trace("soup_cache_load", 'B');
+	soup_cache_load(diskcache);
+	trace("soup_cache_load", 'E');
+
+	return NULL;
+}
+
+/*
+ * Hands the disk cache over to the session, waiting for cacheload() to
+ * finish if need be. Until then requests would miss the cache, so the first
+ * request waits; by then the window is built, which the index was read
+ * alongside of.
+ */
+static void
+cachewait(void) {
+	trace("cache_wait", 'B');
+	g_thread_join(cachethread);
+	cachethread = NULL;
+	soup_session_add_feature(webkit_get_default_session(),
+			SOUP_SESSION_FEATURE(diskcache));
+	trace("cache_wait", 'E');
+}
+
+static void
+cachegotchunk(SoupMessage *msg, SoupBuffer *chunk, gpointer d) {
+	cachestats.networkbytes += chunk->length;
+}
+
+/*
+ * A message actually went out to the network, the cache did not satisfy it.
+ * request-started is emitted again when a message gets restarted, after a
+ * redirect or an authentication, so each message is counted once.
+ */
+static void
+cacherequest(SoupSession *s, SoupMessage *msg, SoupSocket *sock, gpointer d) {
+	if(!g_object_get_data(G_OBJECT(msg), "surf-counted")) {
+		g_object_set_data(G_OBJECT(msg), "surf-counted", msg);
+		cachestats.network++;
+		if(soup_message_headers_get_one(msg->request_headers,
+					"If-None-Match")
+				|| soup_message_headers_get_one(
+					msg->request_headers,
+					"If-Modified-Since")) {
+			cachestats.revalidations++;
+		}
+		g_signal_connect(G_OBJECT(msg), "got-chunk",
+				G_CALLBACK(cachegotchunk), NULL);
+	}
+}
+
+static int
+cacheusecmp(gconstpointer a, gconstpointer b) {
+	time_t ua = ((CacheUse *)a)->used, ub = ((CacheUse *)b)->used;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Counts one more use of the origin, in a file whose mtime doubles as the
+ * time it was last used. Returns the number of uses before this one.
+ */
+static guint
+cacheuses(const char *origin) {
+	char *usage, *path;
+	guint uses = 0;
+	FILE *f;
+
+	usage = g_strdup_printf(originusagefile, origin);
+	path = buildpath(usage);
+	if((f = fopen(path, "r+"))) {
+		if(fscanf(f, "%u", &uses) != 1)
+			uses = 0;
+		rewind(f);
+		fprintf(f, "%u\n", uses + 1);
+		fclose(f);
+	}
+	/* cacheflush() keeps the mtime current */
+	g_free(usagepath);
+	usagepath = path;
+	g_free(usage);
+
+	return uses;
+}
+
+static gboolean
+buttonrelease(WebKitWebView *web, GdkEventButton *e, Client *c) {
+	WebKitHitTestResultContext context;
+	WebKitHitTestResult *result = webkit_web_view_get_hit_test_result(web,
+			e);
 	Arg arg;
+	unsigned int i;
+
+	g_object_get(result, "context", &context, NULL);
+	g_object_get(result, "link-uri", &arg.v, NULL);
+	for(i = 0; i < LENGTH(buttons); i++) {
+		if(context & buttons[i].click && e->button == buttons[i].button &&
+		CLEANMASK(e->state) == CLEANMASK(buttons[i].mask) && buttons[i].func) {
+			buttons[i].func(c, buttons[i].click == ClkLink && buttons[i].arg.i == 0 ? &arg : &buttons[i].arg);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+cleanup(void) {
+	struct stat st;
+
+	quitting = TRUE;
+
+	/* only if no newer surf of our origin has taken it over */
+	if(brokerpath && !stat(brokerpath, &st) && st.st_ino == brokerino)
+		unlink(brokerpath);
+	g_free(brokerpath);
+	if(diskcache) {
+		if(cacheflushid)
+			g_source_remove(cacheflushid);
+		cacheflush(NULL);
+	}
+	if(showstats)
+		printstats();
+	while(clients)
+		destroyclient(clients);
+	g_free(cookiefile);
+	g_free(scriptfile);
+	g_free(stylefile);
+}
+
+static void
+cookiejar_changed(SoupCookieJar *self, SoupCookie *old_cookie,
+		SoupCookie *new_cookie) {
+	CookieJar *j = COOKIEJAR(self);
+	char *line, *key;
+
+	if(old_cookie) {
+		key = cookiejar_key(old_cookie);
+		g_hash_table_remove(j->values, key);
+		g_hash_table_remove(j->session, key);
+		g_free(key);
+	}
+	if(new_cookie) {
+		g_hash_table_replace(j->values, cookiejar_key(new_cookie),
+				g_strdup(new_cookie->value));
+	}
+	if(j->loading || j->readonly)
+		return;
+
+	if(old_cookie) {
+		line = g_strdup_printf("-\t%s\t%s\t%s\n", old_cookie->domain,
+				old_cookie->path, old_cookie->name);
+		cookiejar_log(j, line);
+		g_free(line);
+	}
+
+	/* session cookies live in memory only, but still time out */
+	if(new_cookie && !new_cookie->expires) {
+		g_hash_table_add(j->session, cookiejar_key(new_cookie));
+		if(sessiontime) {
+			soup_cookie_set_expires(new_cookie,
+					soup_date_new_from_now(sessiontime));
+		}
+	} else if(new_cookie) {
+		line = cookiejar_format(new_cookie);
+		cookiejar_log(j, line);
+		g_free(line);
+	}
+
+	if(j->logged >= cookiecompact)
+		cookiejar_compact(j);
+}
+
+static void
+cookiejar_class_init(CookieJarClass *klass) {
+	SOUP_COOKIE_JAR_CLASS(klass)->changed = cookiejar_changed;
+	G_OBJECT_CLASS(klass)->finalize = cookiejar_finalize;
+}
+
+/*
+ * Folds the log into a new snapshot. What other processes of our origin
+ * logged since we last read it is replayed first.
+ */
+static void
+cookiejar_compact(CookieJar *j) {
+	GSList *cookies, *l;
+	char *tmp, *line, *key;
+	struct stat st;
+	FILE *f;
+
+	flock(j->log, LOCK_EX);
+	trace("cookiejar_compact", 'B');
+	cookiejar_replay(j, TRUE);
+
+	tmp = g_strconcat(j->filename, ".tmp", NULL);
+	if((f = fopen(tmp, "w"))) {
+		fchmod(fileno(f), 0600);
+		cookies = soup_cookie_jar_all_cookies(SOUP_COOKIE_JAR(j));
+		for(l = cookies; l; l = l->next) {
+			key = cookiejar_key(l->data);
+			if(!g_hash_table_contains(j->session, key)) {
+				line = cookiejar_format(l->data);
+				fputs(line + 2, f);
+				g_free(line);
+			}
+			g_free(key);
+			soup_cookie_free(l->data);
+		}
+		g_slist_free(cookies);
+		if(fclose(f) == 0 && rename(tmp, j->filename) == 0
+				&& ftruncate(j->log, 0) == 0) {
+			j->logged = 0;
+			j->replayed = 0;
+			if(!stat(j->filename, &st))
+				j->snapshot = st.st_ino;
+		}
+	}
+	g_free(tmp);
+	trace("cookiejar_compact", 'E');
+	flock(j->log, LOCK_UN);
+}
+
+static void
+cookiejar_finalize(GObject *self) {
+	CookieJar *j = COOKIEJAR(self);
+
+	if(j->log != -1)
+		close(j->log);
+	g_hash_table_destroy(j->values);
+	g_hash_table_destroy(j->session);
+	g_free(j->filename);
+	g_free(j->logname);
+	G_OBJECT_CLASS(cookiejar_parent_class)->finalize(self);
+}
+
+/* a log line adding c, of which the cookies.txt line starts at offset 2 */
+static char *
+cookiejar_format(SoupCookie *c) {
+	return g_strdup_printf("+\t%s%s\t%s\t%s\t%s\t%lu\t%s\t%s\n",
+			c->http_only ? "#HttpOnly_" : "", c->domain,
+			c->domain[0] == '.' ? "TRUE" : "FALSE", c->path,
+			c->secure ? "TRUE" : "FALSE",
+			c->expires ? (unsigned long)soup_date_to_time_t(c->expires)
+			: 0UL, c->name, c->value);
+}
+
+static void
+cookiejar_init(CookieJar *self) {
+	self->log = -1;
+	self->values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+	self->session = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			NULL);
+}
+
+/* what tells cookies apart, the same as a removal in the log names them */
+static char *
+cookiejar_key(SoupCookie *c) {
+	return g_strdup_printf("%s\t%s\t%s", c->domain, c->path, c->name);
+}
+
+/* reads the snapshot in filename into the jar */
+static void
+cookiejar_load(CookieJar *j, const char *filename) {
+	SoupCookie *c;
+	char *contents, *line, *next;
+	struct stat st;
+
+	j->snapshot = stat(filename, &st) ? 0 : st.st_ino;
+	if(!g_file_get_contents(filename, &contents, NULL, NULL))
+		return;
+
+	j->loading = TRUE;
+	for(line = contents; line && *line; line = next) {
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+		if((c = cookiejar_parse(line)))
+			soup_cookie_jar_add_cookie(SOUP_COOKIE_JAR(j), c);
+	}
+	j->loading = FALSE;
+	g_free(contents);
+}
+
+/*
+ * Another process folded the log into a new snapshot, which has all that
+ * was logged until then, ours included. It replaces the cookies of the jar
+ * but the session ones, which are never written.
+ */
+static void
+cookiejar_reload(CookieJar *j) {
+	SoupCookieJar *jar = SOUP_COOKIE_JAR(j);
+	GSList *cookies, *l;
+	char *key;
+
+	cookies = soup_cookie_jar_all_cookies(jar);
+	j->loading = TRUE;
+	for(l = cookies; l; l = l->next) {
+		key = cookiejar_key(l->data);
+		if(!g_hash_table_contains(j->session, key))
+			soup_cookie_jar_delete_cookie(jar, l->data);
+		g_free(key);
+		soup_cookie_free(l->data);
+	}
+	j->loading = FALSE;
+	g_slist_free(cookies);
+
+	cookiejar_load(j, j->filename);
+	j->replayed = 0;
+	j->logged = 0;
+}
+
+/*
+ * Applies the part of the log not read yet to the jar. With others set, the
+ * lines this process logged itself are left out, they are in the jar
+ * already, and maybe changed since. The caller holds the lock of the log.
+ */
+static void
+cookiejar_replay(CookieJar *j, gboolean others) {
+	SoupCookieJar *jar = SOUP_COOKIE_JAR(j);
+	SoupCookie *c;
+	struct stat st;
+	char *contents, *line, *next, *body, *f[3];
+	const char *value;
+	ssize_t n;
+	long pid;
+	int fd, i;
+
+	/* a new snapshot, the log was truncated along with it */
+	if(stat(j->filename, &st) ? j->snapshot != 0
+			: st.st_ino != j->snapshot) {
+		cookiejar_reload(j);
+		others = FALSE;
+	}
+
+	if((fd = open(j->logname, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	if(fstat(fd, &st) || st.st_size < j->replayed) {
+		close(fd);
+		return;
+	}
+	contents = g_malloc(st.st_size - j->replayed + 1);
+	n = pread(fd, contents, st.st_size - j->replayed, j->replayed);
+	close(fd);
+	if(n < 0) {
+		g_free(contents);
+		return;
+	}
+	contents[n] = '\0';
+	/* a line still being written is read the next time */
+	if((next = strrchr(contents, '\n')))
+		next[1] = '\0';
+	else
+		contents[0] = '\0';
+	j->replayed += strlen(contents);
+
+	j->loading = TRUE;
+	for(line = contents; line && *line; line = next) {
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+
+		/* +<pid>\t<cookies.txt line> or -<pid>\t<domain>\t<path>\t<name> */
+		j->logged++;
+		if(line[0] != '+' && line[0] != '-')
+			continue;
+		pid = strtol(line + 1, &body, 10);
+		if(*body++ != '\t' || (others && pid == getpid()))
+			continue;
+
+		if(line[0] == '+') {
+			if((c = cookiejar_parse(body)))
+				soup_cookie_jar_add_cookie(jar, c);
+			continue;
+		}
+		if(!(value = g_hash_table_lookup(j->values, body)))
+			continue;
+		f[0] = body = g_strdup(body);
+		for(i = 1; i < LENGTH(f); i++) {
+			if(!(f[i] = strchr(f[i - 1], '\t')))
+				break;
+			*f[i]++ = '\0';
+		}
+		if(i == LENGTH(f)) {
+			/* the jar finds cookies by name, value and path */
+			c = soup_cookie_new(f[2], value, f[0], f[1], -1);
+			soup_cookie_jar_delete_cookie(jar, c);
+			soup_cookie_free(c);
+		}
+		g_free(body);
+	}
+	j->loading = FALSE;
+	g_free(contents);
+}
+
+static void
+cookiejar_log(CookieJar *j, const char *line) {
+	char *tagged;
+
+	if(j->log == -1)
+		return;
+	/* our pid after the +/-, so cookiejar_replay() knows our lines */
+	tagged = g_strdup_printf("%c%d%s", line[0], (int)getpid(), line + 1);
+	/* a single write, so concurrent appends do not interleave */
+	flock(j->log, LOCK_EX);
+	if(write(j->log, tagged, strlen(tagged)) > 0)
+		j->logged++;
+	flock(j->log, LOCK_UN);
+	g_free(tagged);
+}
+
+static SoupCookieJar *
+cookiejar_new(const char *filename, gboolean read_only,
+		SoupCookieJarAcceptPolicy policy) {
+	CookieJar *j = g_object_new(COOKIEJAR_TYPE,
+	                            SOUP_COOKIE_JAR_READ_ONLY, read_only,
+	                            SOUP_COOKIE_JAR_ACCEPT_POLICY, policy, NULL);
+
+	j->readonly = read_only;
+	j->filename = g_strdup(filename);
+	j->logname = g_strconcat(filename, ".log", NULL);
+	if(!read_only) {
+		j->log = open(j->logname, O_WRONLY | O_APPEND | O_CREAT
+				| O_CLOEXEC, 0600);
+	}
+
+	if(j->log != -1)
+		flock(j->log, LOCK_SH);
+	cookiejar_load(j, j->filename);
+	cookiejar_replay(j, FALSE);
+	if(j->log != -1)
+		flock(j->log, LOCK_UN);
+
+	return SOUP_COOKIE_JAR(j);
+}
+
+/* parses a line of cookies.txt, as written by curl or SoupCookieJarText */
+static SoupCookie *
+cookiejar_parse(char *line) {
+	SoupCookie *c;
+	char *f[7];
+	gboolean httponly = FALSE;
+	time_t expires;
+	int i;
+
+	if(g_str_has_prefix(line, "#HttpOnly_")) {
+		httponly = TRUE;
+		line += strlen("#HttpOnly_");
+	} else if(line[0] == '#' || line[0] == '\0') {
+		return NULL;
+	}
+
+	f[0] = line;
+	for(i = 1; i < LENGTH(f); i++) {
+		if(!(f[i] = strchr(f[i - 1], '\t')))
+			return NULL;
+		*f[i]++ = '\0';
+	}
+
+	expires = strtoul(f[4], NULL, 10);
+	if(expires && expires <= time(NULL))
+		return NULL;
+
+	c = soup_cookie_new(f[5], f[6], f[0], f[2], -1);
+	if(expires)
+		soup_cookie_set_expires(c, soup_date_new_from_time_t(expires));
+	soup_cookie_set_secure(c, !strcmp(f[3], "TRUE"));
+	soup_cookie_set_http_only(c, httponly);
+
+	return c;
+}
+
+static SoupCookieJarAcceptPolicy
+cookiepolicy_get(void) {
+	switch(cookiepolicies[policysel]) {
+	case 'a':
+		return SOUP_COOKIE_JAR_ACCEPT_NEVER;
+	case '@':
+		return SOUP_COOKIE_JAR_ACCEPT_NO_THIRD_PARTY;
+	case 'A':
+	default:
+		break;
+	}
+
+	return SOUP_COOKIE_JAR_ACCEPT_ALWAYS;
+}
+
+static char
+cookiepolicy_set(const SoupCookieJarAcceptPolicy ep) {
+	switch(ep) {
+	case SOUP_COOKIE_JAR_ACCEPT_NEVER:
+		return 'a';
+	case SOUP_COOKIE_JAR_ACCEPT_NO_THIRD_PARTY:
+		return '@';
+	case SOUP_COOKIE_JAR_ACCEPT_ALWAYS:
+	default:
+		break;
+	}
+
+	return 'A';
+}
+
+static void
+contentlength(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r,
+		gint length, Client *c) {
+	cachestats.bytes += length;
+	if(c->load.start)
+		c->load.bytes += length;
+}
+
+static gboolean
+controlaccept(GIOChannel *ch, GIOCondition cond, Client *c) {
+	Control *ctl;
+	GIOChannel *cch;
+	int fd;
+
+	if((fd = accept(c->ctlfd, NULL, NULL)) == -1)
+		return TRUE;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ctl = g_new0(Control, 1);
+	ctl->c = c;
+	ctl->fd = fd;
+	ctl->in = g_string_new(NULL);
+	ctl->out = g_string_new(NULL);
+	cch = g_io_channel_unix_new(fd);
+	ctl->id = g_io_add_watch(cch, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			(GIOFunc)controlread, ctl);
+	g_io_channel_unref(cch);
+	c->controls = g_slist_prepend(c->controls, ctl);
+
+	return TRUE;
+}
+
+/* the caller removes the read watch of ctl, if it is still there */
+static void
+controlclose(Control *ctl) {
+	if(ctl->outid)
+		g_source_remove(ctl->outid);
+	ctl->c->controls = g_slist_remove(ctl->c->controls, ctl);
+	close(ctl->fd);
+	g_string_free(ctl->in, TRUE);
+	g_string_free(ctl->out, TRUE);
+	g_free(ctl);
+}
+
+/* sends the pending replies of c, waiting for them; for a process exiting */
+static void
+controldrain(Client *c) {
+	Control *ctl;
+	GSList *l;
+	ssize_t w;
+	gsize off;
+
+	for(l = c->controls; l; l = l->next) {
+		ctl = l->data;
+		fcntl(ctl->fd, F_SETFL, fcntl(ctl->fd, F_GETFL) & ~O_NONBLOCK);
+		for(off = 0; off < ctl->out->len; off += w) {
+			if((w = write(ctl->fd, ctl->out->str + off,
+						ctl->out->len - off)) <= 0) {
+				if(w == -1 && errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				break;
+			}
+		}
+		g_string_truncate(ctl->out, 0);
+	}
+}
+
+/*
+ * Runs one command of the control protocol and appends its reply, a line
+ * starting with "ok" or "err", to out.
+ */
+static void
+controlcommand(Client *c, char *line, GString *out) {
+	char *arg, *s, *t;
+	Arg a;
+
+	if((arg = strchr(line, ' ')))
+		*arg++ = '\0';
+	else
+		arg = "";
+
+	if(!strcmp(line, "load")) {
+		if(!(s = qualify_uri(arg))) {
+			g_string_append(out, "err bad uri\n");
+			return;
+		}
+		/* a cross-origin load may exit this process, see newwindow() */
+		g_string_append(out, "ok\n");
+		a.v = s;
+		loaduri(c, &a, 1);
+		g_free(s);
+		return;
+	} else if(!strcmp(line, "find")) {
+		g_string_append_printf(out, "ok %d\n",
+				webkit_web_view_search_text(c->view, arg,
+					FALSE, TRUE, TRUE));
+		return;
+	} else if(!strcmp(line, "eval")) {
+		if(!(s = evalstring(webkit_web_frame_get_global_context(
+						webkit_web_view_get_main_frame(
+							c->view)), arg))) {
+			g_string_append(out, "err exception\n");
+			return;
+		}
+		g_strdelimit(s, "\r\n", ' ');
+		g_string_append_printf(out, "ok %s\n", s);
+		g_free(s);
+		return;
+	} else if(!strcmp(line, "reload")) {
+		a.b = FALSE;
+		reload(c, &a);
+	} else if(!strcmp(line, "stop")) {
+		stop(c, NULL);
+	} else if(!strcmp(line, "har")) {
+		c->harnext = TRUE;
+	} else if(!strcmp(line, "status")) {
+		t = g_strdup(c->title ? c->title : "");
+		g_strdelimit(t, "\r\n", ' ');
+		s = g_strdup(geturi(c));
+		g_strdelimit(s, " \r\n", '+');
+		g_string_append_printf(out, "ok %d %s %s\n", c->progress,
+				*s ? s : "-", t);
+		g_free(s);
+		g_free(t);
+		return;
+	} else {
+		g_string_append_printf(out, "err unknown command %s\n", line);
+		return;
+	}
+	g_string_append(out, "ok\n");
+}
+
+/*
+ * Listens for commands to c on a socket named after its window and origin,
+ * in $XDG_RUNTIME_DIR/surf/ or else controlfolder.
+ */
+static void
+controllisten(Client *c) {
+	const char *runtime = g_getenv("XDG_RUNTIME_DIR");
+	char *dir, *origin, *name;
+	GIOChannel *ch;
+
+	if(runtime && *runtime)
+		dir = g_build_filename(runtime, "surf", NULL);
+	else
+		dir = expandpath(controlfolder);
+	g_mkdir_with_parents(dir, 0700);
+
+	origin = origin_uri ? origingetfolder(origin_uri) : NULL;
+	name = g_strdup_printf("%u-%s.sock",
+			(guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window),
+			origin ? origin : "none");
+	c->ctlpath = g_build_filename(dir, name, NULL);
+	g_free(name);
+	g_free(origin);
+	g_free(dir);
+
+	if((c->ctlfd = socklisten(c->ctlpath)) == -1) {
+		fprintf(stderr, "surf: cannot listen on %s: %s\n", c->ctlpath,
+				strlen(c->ctlpath) >= sizeof(((struct sockaddr_un *)
+						NULL)->sun_path) ? "path too long"
+				: strerror(errno));
+		g_free(c->ctlpath);
+		c->ctlpath = NULL;
+		return;
+	}
+	ch = g_io_channel_unix_new(c->ctlfd);
+	c->ctlid = g_io_add_watch(ch, G_IO_IN, (GIOFunc)controlaccept, c);
+	g_io_channel_unref(ch);
+}
+
+/*
+ * Runs all complete commands read, queueing their replies in order for
+ * controlwrite().
+ */
+static gboolean
+controlread(GIOChannel *ch, GIOCondition cond, Control *ctl) {
+	char buf[BUFSIZ], *line, *nl;
+	GIOChannel *och;
+	ssize_t n;
+
+	if((n = read(ctl->fd, buf, sizeof(buf))) <= 0) {
+		if(n == -1 && (errno == EAGAIN || errno == EINTR))
+			return TRUE;
+		/* a peer which only shut down its side still gets its replies */
+		ctl->id = 0;
+		if(n == -1 || !ctl->outid)
+			controlclose(ctl);
+		return FALSE;
+	}
+	g_string_append_len(ctl->in, buf, n);
+
+	for(line = ctl->in->str; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = '\0';
+		if(nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		controlcommand(ctl->c, line, ctl->out);
+	}
+	g_string_erase(ctl->in, 0, line - ctl->in->str);
+
+	if(ctl->out->len && !ctl->outid) {
+		och = g_io_channel_unix_new(ctl->fd);
+		ctl->outid = g_io_add_watch(och, G_IO_OUT,
+				(GIOFunc)controlwrite, ctl);
+		g_io_channel_unref(och);
+	}
+
+	return TRUE;
+}
+
+/* sends what the peer takes of the queued replies, never blocking */
+static gboolean
+controlwrite(GIOChannel *ch, GIOCondition cond, Control *ctl) {
+	ssize_t w;
+
+	if((w = write(ctl->fd, ctl->out->str, ctl->out->len)) == -1) {
+		if(errno == EAGAIN || errno == EINTR)
+			return TRUE;
+		ctl->outid = 0;
+		if(ctl->id)
+			g_source_remove(ctl->id);
+		controlclose(ctl);
+		return FALSE;
+	}
+	g_string_erase(ctl->out, 0, w);
+	if(ctl->out->len)
+		return TRUE;
+	ctl->outid = 0;
+	if(!ctl->id)
+		controlclose(ctl);
+	return FALSE;
+}
+
+static void
+evalscript(JSContextRef js, char *script, char* scriptname) {
+	JSStringRef jsscript, jsscriptname;
+	JSValueRef exception = NULL;
+
+	jsscript = JSStringCreateWithUTF8CString(script);
+	jsscriptname = JSStringCreateWithUTF8CString(scriptname);
+	JSEvaluateScript(js, jsscript, JSContextGetGlobalObject(js),
+			jsscriptname, 0, &exception);
+	JSStringRelease(jsscript);
+	JSStringRelease(jsscriptname);
+}
+
+/* the result of script as a string, or NULL when it threw */
+static char *
+evalstring(JSContextRef js, const char *script) {
+	JSStringRef jsscript, jsresult;
+	JSValueRef result, exception = NULL;
+	size_t len;
+	char *s;
+
+	jsscript = JSStringCreateWithUTF8CString(script);
+	result = JSEvaluateScript(js, jsscript, JSContextGetGlobalObject(js),
+			NULL, 0, &exception);
+	JSStringRelease(jsscript);
+	if(!result || exception)
+		return NULL;
+
+	jsresult = JSValueToStringCopy(js, result, NULL);
+	len = JSStringGetMaximumUTF8CStringSize(jsresult);
+	s = g_malloc(len);
+	JSStringGetUTF8CString(jsresult, s, len);
+	JSStringRelease(jsresult);
+
+	return s;
+}
+
+/* runs scriptfile, and the site scripts matching the uri of frame */
+static void
+runscript(WebKitWebFrame *frame) {
+	JSGlobalContextRef js = webkit_web_frame_get_global_context(frame);
+	const char *uri;
+	char *source;
+	int i;
+
+	if(!userscript)
+		userscript = scriptnew(scriptfile);
+	if(*(source = scriptget(userscript)))
+		evalscript(js, source, scriptfile);
+
+	if(!(uri = webkit_web_frame_get_uri(frame)))
+		return;
+	for(i = 0; i < LENGTH(scripts); i++) {
+		if(scriptcompile(&scripts[i]) && !regexec(&(scripts[i].re),
+					uri, 0, NULL, 0)
+				&& *(source = scriptget(scripts[i].script))) {
+			evalscript(js, source, scripts[i].script->path);
+		}
+	}
+}
+
+static void
+scriptchanged(GFileMonitor *m, GFile *f, GFile *other,
+		GFileMonitorEvent event, Script *s) {
+	g_free(s->source);
+	s->source = NULL;
+}
+
+/* compiles s on first use, telling whether it is usable */
+static gboolean
+scriptcompile(SiteScript *s) {
+	char *path, *dir;
+
+	if(s->script)
+		return TRUE;
+	if(!s->regex)
+		return FALSE;
+
+	if(regcomp(&(s->re), s->regex, REG_EXTENDED | REG_NOSUB)) {
+		fprintf(stderr, "Could not compile regex: %s\n", s->regex);
+		s->regex = NULL;
+		return FALSE;
+	}
+	dir = buildpath(scriptdir);
+	path = g_strconcat(dir, s->file, NULL);
+	s->script = scriptnew(path);
+	g_free(path);
+	g_free(dir);
+
+	return TRUE;
+}
+
+/* returns the source of s, which is empty if it cannot be read */
+static char *
+scriptget(Script *s) {
+	if(!s->source && !g_file_get_contents(s->path, &s->source, NULL,
+				NULL)) {
+		s->source = g_strdup("");
+	}
+	return s->source;
+}
+
+static Script *
+scriptnew(const char *path) {
+	Script *s = g_new0(Script, 1);
+	GFile *f;
+
+	s->path = g_strdup(path);
+	f = g_file_new_for_path(path);
+	if((s->monitor = g_file_monitor_file(f, G_FILE_MONITOR_NONE, NULL,
+					NULL))) {
+		g_signal_connect(G_OBJECT(s->monitor), "changed",
+				G_CALLBACK(scriptchanged), s);
+	}
+	g_object_unref(f);
+
+	return s;
+}
+
+static void
+clipboard(Client *c, const Arg *arg) {
+	gboolean paste = *(gboolean *)arg;
+
+	if(paste) {
+		gtk_clipboard_request_text(
+				gtk_clipboard_get(GDK_SELECTION_PRIMARY),
+				pasteuri, c);
+	} else {
+		gtk_clipboard_set_text(
+				gtk_clipboard_get(GDK_SELECTION_PRIMARY),
+				c->linkhover ? c->linkhover : geturi(c), -1);
+	}
+}
 
-	if (!useragent) {
-		useragentscramble(view);
+static char *
+copystr(char **str, const char *src) {
+	char *tmp;
+	tmp = g_strdup(src);
+
+	if(str && *str) {
+		g_free(*str);
+		*str = tmp;
 	}
-	acceptlanguagescramble();
+	return tmp;
+}
+
+static WebKitWebView *
+createwindow(WebKitWebView  *v, WebKitWebFrame *f, Client *c) {
+	Client *n = newclient();
+	return n->view;
+}
+
+static gboolean
+decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r,
+		gchar *m,  WebKitWebPolicyDecision *p, Client *c) {
+	if(!webkit_web_view_can_show_mime_type(v, m) && !webkit_web_frame_get_parent(f)) {
+		webkit_web_policy_decision_download(p);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static gboolean
+decidenavigation(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r,
+		WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p,
+		Client *c) {
+	const char *uri = webkit_network_request_get_uri(r);
+	Arg arg;
 
 	if (!sameoriginpolicy) {
 		/* configured to not bother isolating origins */
@@ -554,26 +2333,121 @@ deletion_interface(WebKitWebView *view,
 static void
 destroyclient(Client *c) {
 	Client *p;
+	GSList *l;
+	int i;
 
+	/* the view is gone before the window loses focus */
+	g_signal_handlers_disconnect_by_func(G_OBJECT(c->win),
+			G_CALLBACK(sessionfocus), c);
+	g_signal_handlers_disconnect_by_func(G_OBJECT(c->win),
+			G_CALLBACK(visibilitychange), c);
+	if(c->discardid)
+		g_source_remove(c->discardid);
+	g_free(c->discarduri);
+	if(c->har)
+		harfree(c->har);
+	if(c->titleid)
+		g_source_remove(c->titleid);
+	if(c->atomid)
+		g_source_remove(c->atomid);
+	while(c->controls) {
+		if(((Control *)c->controls->data)->id)
+			g_source_remove(((Control *)c->controls->data)->id);
+		controlclose(c->controls->data);
+	}
+	if(c->ctlpath) {
+		g_source_remove(c->ctlid);
+		close(c->ctlfd);
+		unlink(c->ctlpath);
+		g_free(c->ctlpath);
+	}
 	webkit_web_view_stop_loading(c->view);
 	gtk_widget_destroy(GTK_WIDGET(c->view));
 	gtk_widget_destroy(c->scroll);
 	gtk_widget_destroy(c->vbox);
 	gtk_widget_destroy(c->win);
 
+	for(l = downloads; l; l = l->next) {
+		if(((Download *)l->data)->c == c)
+			((Download *)l->data)->c = NULL;
+	}
+
 	for(p = clients; p && p->next != c; p = p->next);
 	if(p) {
 		p->next = c->next;
 	} else {
 		clients = c->next;
 	}
+	g_free(c->wintitle);
+	for(i = 0; i < AtomLast; i++)
+		g_free(c->atomval[i]);
 	free(c);
-	if(clients == NULL)
+	/* or once the last download is done */
+	if(clients == NULL && downloads == NULL)
 		gtk_main_quit();
 }
 
+/*
+ * Empties the page of c, which has been unmapped for discardafter
+ * seconds, to give its memory back. The back forward list is left as it
+ * is, and undiscard() reloads the page, revalidating it in the cache.
+ */
+static gboolean
+discard(Client *c) {
+	const char *uri = geturi(c);
+
+	/* try again later */
+	if(c->progress != 100 || c->isinspecting)
+		return TRUE;
+
+	c->discardid = 0;
+	if(!*uri || !strcmp(uri, "about:blank"))
+		return FALSE;
+	c->discardrss = rsskb();
+	c->discarduri = g_strdup(uri);
+	c->discardy = gtk_adjustment_get_value(
+			gtk_scrolled_window_get_vadjustment(
+				GTK_SCROLLED_WINDOW(c->scroll)));
+	c->discarded = TRUE;
+	trace("discard", 'i');
+	/*
+	 * an empty page in place of the current one, at the same uri, so the
+	 * back forward list stays as it is
+	 */
+	webkit_web_frame_load_alternate_string(
+			webkit_web_view_get_main_frame(c->view), "", uri, uri);
+
+	return FALSE;
+}
+
+/* the page is gone, collect what it left behind */
+static void
+discardcollect(Client *c) {
+	WebKitWebFrame *frame = webkit_web_view_get_main_frame(c->view);
+
+	JSGarbageCollect(webkit_web_frame_get_global_context(frame));
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	if(showstats) {
+		fprintf(stderr, "surf[%d]: discarded %s: %ld kB -> %ld kB "
+				"resident\n", (int)getpid(), c->discarduri,
+				c->discardrss, rsskb());
+	}
+}
+
+/* closes c once the signal handlers running now are done with it */
+static gboolean
+destroyidle(Client *c) {
+	gtk_widget_destroy(c->win);
+	return FALSE;
+}
+
 static void
 destroywin(GtkWidget* w, Client *c) {
+	/* closed by the user, rather than surf shutting down */
+	if(!quitting)
+		sessionforget(c);
 	destroyclient(c);
 }
 
@@ -587,6 +2461,44 @@ die(const char *errstr, ...) {
 	exit(EXIT_FAILURE);
 }
 
+/* removes the files in path, but not path itself or its subdirectories */
+static void
+dirempty(const char *path) {
+	const char *name;
+	char *f;
+	GDir *dir;
+
+	if(!(dir = g_dir_open(path, 0, NULL)))
+		return;
+	while((name = g_dir_read_name(dir))) {
+		f = g_build_filename(path, name, NULL);
+		g_unlink(f);
+		g_free(f);
+	}
+	g_dir_close(dir);
+}
+
+static guint64
+dirsize(const char *path) {
+	const char *name;
+	char *f;
+	GDir *dir;
+	struct stat st;
+	guint64 size = 0;
+
+	if(!(dir = g_dir_open(path, 0, NULL)))
+		return 0;
+	while((name = g_dir_read_name(dir))) {
+		f = g_build_filename(path, name, NULL);
+		if(!stat(f, &st) && S_ISREG(st.st_mode))
+			size += st.st_size;
+		g_free(f);
+	}
+	g_dir_close(dir);
+
+	return size;
+}
+
 static void
 find(Client *c, const Arg *arg) {
 	const char *s;
@@ -616,68 +2528,815 @@ geopolicyrequested(WebKitWebView *v, WebKitWebFrame *f,
 	}
 }
 
+/*
+ * Returns property a of the window of c. Only values others have written
+ * since we last looked are fetched from the X server.
+ */
 static const char *
 getatom(Client *c, int a) {
-	static char buf[BUFSIZ];
 	Atom adummy;
 	int idummy;
 	unsigned long ldummy;
 	unsigned char *p = NULL;
 
+	if(c->atomval[a])
+		return c->atomval[a];
+
+	xstats.roundtrips++;
 	XGetWindowProperty(dpy, GDK_WINDOW_XID(GTK_WIDGET(c->win)->window),
 			atoms[a], 0L, BUFSIZ, False, XA_STRING,
 			&adummy, &idummy, &ldummy, &ldummy, &p);
-	if(p) {
-		strncpy(buf, (char *)p, LENGTH(buf)-1);
-	} else {
-		buf[0] = '\0';
-	}
+	c->atomval[a] = g_strdup(p ? (char *)p : "");
 	XFree(p);
 
-	return buf;
+	return c->atomval[a];
 }
 
 static char *
 geturi(Client *c) {
 	char *uri;
 
-	if(!(uri = (char *)webkit_web_view_get_uri(c->view)))
-		uri = "";
-	return uri;
+	if(!(uri = (char *)webkit_web_view_get_uri(c->view)))
+		uri = "";
+	return uri;
+}
+
+/*
+ * Returns the stylesheet uri for the origin of uri, which is what the styles
+ * are matched against, or uri itself when it has no origin. The result is
+ * memoized per origin and must not be freed.
+ */
+static const char *
+getstyle(const char *uri) {
+	const char *style = "", *origin;
+	const Origin *o;
+	int i;
+
+	if(stylefile != NULL)
+		return stylefile;
+
+	origin = (o = originget(uri)) ? o->uri : uri;
+	if(!stylememo) {
+		stylememo = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
+	} else if(g_hash_table_lookup_extended(stylememo, origin, NULL,
+				(gpointer *)&style)) {
+		return style;
+	}
+
+	for(i = 0; i < LENGTH(styles); i++) {
+		if(stylecompile(&styles[i]) && !regexec(&(styles[i].re),
+					origin, 0, NULL, 0)) {
+			style = styles[i].file;
+			break;
+		}
+	}
+	g_hash_table_insert(stylememo, g_strdup(origin), (gpointer)style);
+	return style;
+}
+
+static void
+handleplumb(Client *c, WebKitWebView *w, const gchar *uri) {
+	Arg arg;
+
+	webkit_web_view_stop_loading(w);
+	arg = (Arg)PLUMB((char *)uri);
+	spawn(c, &arg);
+}
+
+static void
+harchunk(SoupMessage *msg, SoupBuffer *chunk, HarEntry *e) {
+	e->bytes += chunk->length;
+}
+
+static void
+harentryfree(gpointer data) {
+	HarEntry *e = data;
+
+	if(e->msg) {
+		g_signal_handlers_disconnect_matched(G_OBJECT(e->msg),
+				G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, e);
+		g_object_unref(e->msg);
+	}
+	g_free(e->uri);
+	g_free(e);
+}
+
+static void
+harfinished(SoupMessage *msg, HarEntry *e) {
+	e->end = g_get_monotonic_time();
+}
+
+static void
+harfree(Har *har) {
+	g_ptr_array_free(har->entries, TRUE);
+	g_free(har);
+}
+
+static void
+harheaders(SoupMessage *msg, HarEntry *e) {
+	if(!e->headers)
+		e->headers = g_get_monotonic_time();
+}
+
+/* connections soup reuses emit none of these */
+static void
+harnetwork(SoupMessage *msg, GSocketClientEvent event, GIOStream *connection,
+		HarEntry *e) {
+	gint64 now = g_get_monotonic_time();
+
+	switch(event) {
+	case G_SOCKET_CLIENT_RESOLVING:
+		e->dnsstart = now;
+		break;
+	case G_SOCKET_CLIENT_RESOLVED:
+		e->dns = now;
+		break;
+	case G_SOCKET_CLIENT_CONNECTING:
+		if(!e->connstart)
+			e->connstart = now;
+		break;
+	case G_SOCKET_CLIENT_TLS_HANDSHAKING:
+		e->tlsstart = now;
+		break;
+	case G_SOCKET_CLIENT_TLS_HANDSHAKED:
+		e->tls = now;
+		break;
+	case G_SOCKET_CLIENT_COMPLETE:
+		e->connect = now;
+		break;
+	default:
+		break;
+	}
+}
+
+/* writes s as a JSON string */
+static void
+harputs(FILE *f, const char *s) {
+	fputc('"', f);
+	for(; s && *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * The session queued msg, which may be the one a captured request of some
+ * window is waiting for; that one is followed until it is done.
+ */
+static void
+harqueued(SoupSession *s, SoupMessage *msg, gpointer d) {
+	HarEntry *e;
+	Client *c;
+	char *uri = NULL;
+	guint i;
+
+	for(c = clients; c; c = c->next) {
+		if(!c->har)
+			continue;
+		if(!uri)
+			uri = soup_uri_to_string(soup_message_get_uri(msg),
+					FALSE);
+		for(i = 0; i < c->har->entries->len; i++) {
+			e = g_ptr_array_index(c->har->entries, i);
+			if(e->msg || strcmp(e->uri, uri))
+				continue;
+			e->msg = g_object_ref(msg);
+			g_signal_connect(G_OBJECT(msg), "network-event",
+					G_CALLBACK(harnetwork), e);
+			g_signal_connect(G_OBJECT(msg), "wrote-body",
+					G_CALLBACK(harwrote), e);
+			g_signal_connect(G_OBJECT(msg), "got-headers",
+					G_CALLBACK(harheaders), e);
+			g_signal_connect(G_OBJECT(msg), "got-chunk",
+					G_CALLBACK(harchunk), e);
+			g_signal_connect(G_OBJECT(msg), "finished",
+					G_CALLBACK(harfinished), e);
+			g_free(uri);
+			return;
+		}
+	}
+	g_free(uri);
+}
+
+/*
+ * Records a request of the captured load. The message of req is only a
+ * copy WebKit takes the headers back from, it is never sent, so the one
+ * the session queues for the same uri is looked for in harqueued().
+ */
+static void
+harrequest(Har *har, WebKitNetworkRequest *req) {
+	HarEntry *e;
+
+	e = g_new0(HarEntry, 1);
+	e->start = g_get_monotonic_time();
+	/* soup leaves the fragment out */
+	e->uri = g_strdup(webkit_network_request_get_uri(req));
+	e->uri[strcspn(e->uri, "#")] = '\0';
+	g_ptr_array_add(har->entries, e);
+}
+
+/* decides whether the load starting in c gets captured */
+static void
+harstart(Client *c) {
+	if(c->har) {
+		harfree(c->har);
+		c->har = NULL;
+	}
+	if(!c->harnext && (harsample <= 0 || g_random_double() >= harsample))
+		return;
+
+	c->harnext = FALSE;
+	c->har = g_new0(Har, 1);
+	c->har->wall = g_get_real_time();
+	c->har->start = g_get_monotonic_time();
+	c->har->entries = g_ptr_array_new_with_free_func(harentryfree);
+}
+
+#define HARMS(from, to) ((from) && (to) >= (from) ? \
+		((to) - (from)) / 1000.0 : -1.0)
+
+/*
+ * Writes the load captured in c as a HAR 1.2 file into harfolder. Requests
+ * still going are written as far as they got.
+ */
+static void
+harwrite(Client *c) {
+	Har *har = c->har;
+	HarEntry *e;
+	SoupMessage *msg;
+	char *origin, *name = NULL, *dir, *path = NULL, date[32];
+	const char *uri = geturi(c), *type;
+	gint64 ready, sent, headers, end, wall;
+	time_t t;
+	guint i, n;
+	int minor, fd = -1;
+	FILE *f;
+
+	if(!har)
+		return;
+	c->har = NULL;
+	origin = origingetfolder(uri);
+	dir = buildpath(harfolder);
+	/* never over another capture, of this process or any other */
+	for(n = 0; fd == -1 && n < 100; n++) {
+		g_free(name);
+		g_free(path);
+		name = g_strdup_printf("%s-%" G_GINT64_FORMAT "-%d-%u.har",
+				origin ? origin : "none", har->wall,
+				(int)getpid(), n);
+		path = g_build_filename(dir, name, NULL);
+		if((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1
+				&& errno != EEXIST)
+			break;
+	}
+	if(fd == -1 || !(f = fdopen(fd, "w"))) {
+		fprintf(stderr, "surf: cannot write %s: %s\n", path,
+				strerror(errno));
+		if(fd != -1)
+			close(fd);
+		goto out;
+	}
+
+	t = har->wall / G_USEC_PER_SEC;
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+	fprintf(f, "{\"log\":{\"version\":\"1.2\",\"creator\":{\"name\":"
+			"\"surf\",\"version\":\"" VERSION "\"},\"pages\":[{"
+			"\"startedDateTime\":\"%s.%03dZ\",\"id\":\"page\","
+			"\"title\":", date,
+			(int)(har->wall % G_USEC_PER_SEC / 1000));
+	harputs(f, uri);
+	fprintf(f, ",\"pageTimings\":{\"onContentLoad\":-1,\"onLoad\":%.3f}}"
+			"],\"entries\":[",
+			(g_get_monotonic_time() - har->start) / 1000.0);
+
+	for(i = 0; i < har->entries->len; i++) {
+		e = g_ptr_array_index(har->entries, i);
+		msg = e->msg;
+
+		/* a request which never got as far counts as done there */
+		ready = e->tls ? e->tls : e->connect;
+		sent = e->sent ? e->sent : ready ? ready : e->start;
+		headers = e->headers ? e->headers : sent;
+		end = e->end ? e->end : headers;
+		wall = har->wall + e->start - har->start;
+		minor = msg && soup_message_get_http_version(msg)
+			== SOUP_HTTP_1_0 ? 0 : 1;
+		t = wall / G_USEC_PER_SEC;
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+
+		fprintf(f, "%s{\"pageref\":\"page\",\"startedDateTime\":"
+				"\"%s.%03dZ\",\"time\":%.3f,\"request\":{"
+				"\"method\":", i ? "," : "", date,
+				(int)(wall % G_USEC_PER_SEC / 1000),
+				(end - e->start) / 1000.0);
+		harputs(f, msg ? msg->method : "GET");
+		fprintf(f, ",\"url\":");
+		harputs(f, e->uri);
+		fprintf(f, ",\"httpVersion\":\"HTTP/1.%d\",\"cookies\":[],"
+				"\"headers\":[],\"queryString\":[],"
+				"\"headersSize\":-1,\"bodySize\":-1},"
+				"\"response\":{\"status\":%u,\"statusText\":",
+				minor, msg && e->headers ? msg->status_code : 0);
+		harputs(f, msg && e->headers ? msg->reason_phrase : "");
+		type = msg && e->headers ? soup_message_headers_get_content_type(
+				msg->response_headers, NULL) : NULL;
+		fprintf(f, ",\"httpVersion\":\"HTTP/1.%d\",\"cookies\":[],"
+				"\"headers\":[],\"content\":{\"size\":%"
+				G_GINT64_FORMAT ",\"mimeType\":",
+				minor, (gint64)e->bytes);
+		harputs(f, type ? type : "");
+		fprintf(f, "},\"redirectURL\":\"\",\"headersSize\":-1,"
+				"\"bodySize\":%" G_GINT64_FORMAT "},"
+				"\"cache\":{},\"timings\":{\"blocked\":%.3f,"
+				"\"dns\":%.3f,\"connect\":%.3f,\"ssl\":%.3f,"
+				"\"send\":%.3f,\"wait\":%.3f,\"receive\":%.3f}}",
+				(gint64)e->bytes,
+				HARMS(e->start, e->dnsstart ? e->dnsstart :
+					e->connstart ? e->connstart : sent),
+				HARMS(e->dnsstart, e->dns),
+				HARMS(e->connstart, e->connect),
+				HARMS(e->tlsstart, e->tls),
+				ready ? HARMS(ready, sent) : 0.0,
+				HARMS(sent, headers), HARMS(headers, end));
+	}
+	fprintf(f, "]}}\n");
+	fclose(f);
+
+out:
+	harfree(har);
+	g_free(path);
+	g_free(dir);
+	g_free(name);
+	g_free(origin);
+}
+
+static void
+harwrote(SoupMessage *msg, HarEntry *e) {
+	e->sent = g_get_monotonic_time();
+}
+
+static void
+downloadchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s) {
+	Download *d = s->d;
+	goffset len = chunk->length;
+
+	if(s->done || d->failed || !SOUP_STATUS_IS_SUCCESSFUL(msg->status_code))
+		return;
+	if(s->end != -1 && s->pos + s->buf->len + len > s->end)
+		len = s->end - s->pos - s->buf->len;
+	g_byte_array_append(s->buf, (const guint8 *)chunk->data, len);
+	d->received += len;
+	if(d->c)
+		updatetitle(d->c);
+
+	if(s->end != -1 && s->pos + s->buf->len >= s->end) {
+		/* the rest belongs to the next segment */
+		downloadflush(s);
+		s->done = TRUE;
+		soup_session_cancel_message(webkit_get_default_session(), msg,
+				SOUP_STATUS_CANCELLED);
+	} else if(s->buf->len >= DOWNLOADBUF) {
+		downloadflush(s);
+	}
+}
+
+static void
+downloaddone(Download *d) {
+	int i;
+
+	if(d->fd != -1)
+		close(d->fd);
+	if(!d->part) {
+		/* nowhere to save it was given */
+	} else if(!d->failed && rename(d->part, d->path) == 0) {
+		g_unlink(d->state);
+	} else {
+		if(d->fd != -1) {
+			/* keep what we have, downloading it again resumes */
+			downloadsave(d);
+		}
+		fprintf(stderr, "surf: download of %s failed\n", d->uri);
+	}
+
+	downloads = g_slist_remove(downloads, d);
+	if(d->c)
+		updatetitle(d->c);
+	/* the windows may all have been closed while it ran */
+	else if(!clients && !downloads)
+		gtk_main_quit();
+	for(i = 0; i < d->nseg; i++)
+		g_byte_array_free(d->seg[i].buf, TRUE);
+	if(d->answer)
+		g_string_free(d->answer, TRUE);
+	g_free(d->validator);
+	g_free(d->uri);
+	g_free(d->referer);
+	g_free(d->useragent);
+	g_free(d->path);
+	g_free(d->part);
+	g_free(d->state);
+	g_free(d);
+}
+
+static void
+downloadfinished(SoupSession *session, SoupMessage *msg, gpointer data) {
+	Segment *s = data;
+	Download *d = s->d;
+	int i;
+
+	s->msg = NULL;
+	d->active--;
+	if(!s->done) {
+		downloadflush(s);
+		if(SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)
+				&& (s->end == -1 || s->pos == s->end)) {
+			s->done = TRUE;
+			if(s->end == -1)
+				d->size = s->pos;
+		} else if(!d->failed) {
+			d->failed = TRUE;
+			/* cancelling finishes them right away */
+			d->active++;
+			for(i = 0; i < d->nseg; i++) {
+				if(d->seg[i].msg) {
+					soup_session_cancel_message(session,
+						d->seg[i].msg,
+						SOUP_STATUS_CANCELLED);
+				}
+			}
+			d->active--;
+		}
+	}
+	if(d->active == 0)
+		downloaddone(d);
+}
+
+static void
+downloadflush(Segment *s) {
+	Download *d = s->d;
+	gsize off;
+	ssize_t n;
+
+	for(off = 0; off < s->buf->len; off += n) {
+		n = pwrite(d->fd, s->buf->data + off, s->buf->len - off,
+				s->pos + off);
+		if(n == -1 && errno == EINTR) {
+			n = 0;
+		} else if(n <= 0) {
+			d->failed = TRUE;
+			break;
+		}
+	}
+	s->pos += off;
+	g_byte_array_set_size(s->buf, 0);
+
+	/* what the state says is on disk always is */
+	if(g_get_monotonic_time() - d->saved > G_USEC_PER_SEC)
+		downloadsave(d);
+}
+
+/*
+ * The first request asks for all bytes as a range. If the server supports
+ * ranges and the file is large, the first segment is cut short and the
+ * rest is fetched by parallel requests.
+ */
+static void
+downloadheaders(SoupMessage *msg, Segment *s) {
+	Download *d = s->d;
+	goffset start, end, total, n;
+	int i;
+
+	if(SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) && !d->validator)
+		d->validator = downloadvalidator(msg);
+
+	if(msg->status_code == SOUP_STATUS_PARTIAL_CONTENT) {
+		if(!soup_message_headers_get_content_range(
+					msg->response_headers, &start, &end,
+					&total) || start != s->pos) {
+			soup_session_cancel_message(
+					webkit_get_default_session(), msg,
+					SOUP_STATUS_CANCELLED);
+			return;
+		}
+		if(d->size == -1 && total > 0)
+			d->size = total;
+		if(s != d->seg || d->nseg != 1 || s->end != -1 || s->pos != 0
+				|| d->size < downloadsplit
+				|| downloadsegments < 2)
+			return;
+
+		d->nseg = MIN(downloadsegments, LENGTH(d->seg));
+		n = d->size / d->nseg;
+		s->end = n;
+		for(i = 1; i < d->nseg; i++) {
+			d->seg[i].d = d;
+			d->seg[i].buf = g_byte_array_new();
+			d->seg[i].pos = i * n;
+			d->seg[i].end = i == d->nseg - 1 ? d->size : (i + 1) * n;
+			downloadstart(&d->seg[i]);
+		}
+		downloadsave(d);
+	} else if(SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) {
+		/*
+		 * no ranges, or If-Range found the file changed: what we have
+		 * is of no use, this response has all of it
+		 */
+		if(s->pos != 0 || d->nseg != 1) {
+			downloadrestart(d, s);
+			g_free(d->validator);
+			d->validator = downloadvalidator(msg);
+			downloadsave(d);
+		}
+		total = soup_message_headers_get_content_length(
+				msg->response_headers);
+		if(total > 0)
+			d->size = total;
+	}
+}
+
+/* s fetches the whole file again, from scratch, the others are dropped */
+static void
+downloadrestart(Download *d, Segment *s) {
+	Segment *o;
+	int i;
+
+	for(i = 0; i < d->nseg; i++) {
+		if((o = &d->seg[i]) == s)
+			continue;
+		/* done, and so saved as a range of nothing */
+		o->done = TRUE;
+		o->pos = o->end = 0;
+		g_byte_array_set_size(o->buf, 0);
+		if(o->msg) {
+			soup_session_cancel_message(
+					webkit_get_default_session(), o->msg,
+					SOUP_STATUS_CANCELLED);
+		}
+	}
+	s->pos = 0;
+	s->end = -1;
+	s->done = FALSE;
+	g_byte_array_set_size(s->buf, 0);
+	d->size = -1;
+	d->received = 0;
+	if(ftruncate(d->fd, 0))
+		d->failed = TRUE;
+}
+
+/*
+ * Picks up the download of d->uri into d->part, if one was interrupted.
+ * Without a validator to send in If-Range the part cannot be trusted, and
+ * is started over.
+ */
+static gboolean
+downloadresume(Download *d) {
+	char *contents, **lines, *end;
+	Segment *s;
+	int i;
+
+	if(!g_file_get_contents(d->state, &contents, NULL, NULL))
+		return FALSE;
+	lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+	if(!lines[0] || strcmp(lines[0], d->uri) || !lines[1]
+			|| (d->fd = open(d->part, O_WRONLY | O_CLOEXEC)) == -1) {
+		g_strfreev(lines);
+		return FALSE;
+	}
+
+	/* <size>[ <validator>] */
+	d->size = g_ascii_strtoll(lines[1], &end, 10);
+	if(*end == ' ' && end[1])
+		d->validator = g_strdup(end + 1);
+	d->received = MAX(d->size, 0);
+	for(i = 2; lines[i] && *lines[i] && d->nseg < LENGTH(d->seg); i++) {
+		s = &d->seg[d->nseg++];
+		s->d = d;
+		s->buf = g_byte_array_new();
+		if(sscanf(lines[i], "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+					&s->pos, &s->end) != 2) {
+			s->done = TRUE;
+			continue;
+		}
+		if(s->end != -1)
+			d->received -= s->end - s->pos;
+		s->done = s->end != -1 && s->pos >= s->end;
+	}
+	g_strfreev(lines);
+
+	if(d->nseg == 0) {
+		close(d->fd);
+		d->fd = -1;
+		return FALSE;
+	}
+	if(!d->validator)
+		downloadrestart(d, d->seg);
+	return TRUE;
+}
+
+/* records the progress of d, so an interrupted download can resume */
+static void
+downloadsave(Download *d) {
+	GString *state = g_string_new(NULL);
+	int i;
+
+	g_string_append_printf(state, "%s\n%" G_GINT64_FORMAT "%s%s\n", d->uri,
+			(gint64)d->size, d->validator ? " " : "",
+			d->validator ? d->validator : "");
+	for(i = 0; i < d->nseg; i++) {
+		g_string_append_printf(state, "%" G_GINT64_FORMAT " %"
+				G_GINT64_FORMAT "\n",
+				(gint64)d->seg[i].pos, (gint64)d->seg[i].end);
+	}
+	g_file_set_contents(d->state, state->str, state->len, NULL);
+	g_string_free(state, TRUE);
+	d->saved = g_get_monotonic_time();
+}
+
+static void
+downloadstart(Segment *s) {
+	Download *d = s->d;
+	SoupMessage *msg;
+
+	if(!(msg = soup_message_new("GET", d->uri))) {
+		d->failed = TRUE;
+		return;
+	}
+	/* neither worth caching nor to be decoded in pieces */
+	soup_message_disable_feature(msg, SOUP_TYPE_CACHE);
+	soup_message_disable_feature(msg, SOUP_TYPE_CONTENT_DECODER);
+	soup_message_body_set_accumulate(msg->response_body, FALSE);
+	soup_message_headers_set_range(msg->request_headers, s->pos,
+			s->end == -1 ? -1 : s->end - 1);
+	/* a file changed meanwhile comes whole, see downloadheaders() */
+	if(d->validator && (s->pos != 0 || s->end != -1))
+		soup_message_headers_replace(msg->request_headers, "If-Range",
+				d->validator);
+	if(d->referer)
+		soup_message_headers_replace(msg->request_headers, "Referer",
+				d->referer);
+	if(d->useragent)
+		soup_message_headers_replace(msg->request_headers,
+				"User-Agent", d->useragent);
+	g_signal_connect(G_OBJECT(msg), "got-headers",
+			G_CALLBACK(downloadheaders), s);
+	g_signal_connect(G_OBJECT(msg), "got-chunk",
+			G_CALLBACK(downloadchunk), s);
+	/* not a request of a page, keep it out of the cache counters */
+	g_object_set_data(G_OBJECT(msg), "surf-counted", msg);
+
+	s->msg = msg;
+	d->active++;
+	soup_session_queue_message(webkit_get_default_session(), msg,
+			downloadfinished, s);
+}
+
+static char *
+downloadvalidator(SoupMessage *msg) {
+	const char *v;
+
+	/* a weak ETag may not be used in If-Range */
+	if((v = soup_message_headers_get_one(msg->response_headers, "ETag"))
+			&& !g_str_has_prefix(v, "W/"))
+		return g_strdup(v);
+	if((v = soup_message_headers_get_one(msg->response_headers,
+					"Last-Modified")))
+		return g_strdup(v);
+	return NULL;
 }
 
-static gchar *
-getstyle(const char *uri) {
-	int i;
+/* downloadprompt answered with the path to save to, or nothing */
+static gboolean
+downloadasked(GIOChannel *ch, GIOCondition cond, Download *d) {
+	char buf[BUFSIZ], *path, *dir, *name;
+	ssize_t n;
 
-	if(stylefile != NULL)
-		return g_strconcat("file://", stylefile, NULL);
+	if((n = read(g_io_channel_unix_get_fd(ch), buf, sizeof(buf))) > 0) {
+		g_string_append_len(d->answer, buf, n);
+		return TRUE;
+	}
+	if(n == -1 && errno == EINTR)
+		return TRUE;
 
-	for(i = 0; i < LENGTH(styles); i++) {
-		if(styles[i].regex && !regexec(&(styles[i].re), uri, 0,
-					NULL, 0)) {
-			return g_strconcat("file://", styles[i].style, NULL);
-		}
+	g_strstrip(d->answer->str);
+	if(!*d->answer->str) {
+		downloaddone(d);
+		return FALSE;
 	}
-	return g_strdup("");
+	path = expandpath(d->answer->str);
+	dir = g_path_get_dirname(path);
+	name = g_path_get_basename(path);
+	g_mkdir_with_parents(dir, 0700);
+	downloadbegin(d, dir, name);
+	g_free(name);
+	g_free(dir);
+	g_free(path);
+
+	return FALSE;
 }
 
+/* saves d as name in dir, numbered if taken, unless it resumes there */
 static void
-handleplumb(Client *c, WebKitWebView *w, const gchar *uri) {
-	Arg arg;
+downloadbegin(Download *d, const char *dir, const char *name) {
+	int i;
 
-	webkit_web_view_stop_loading(w);
-	arg = (Arg)PLUMB((char *)uri);
-	spawn(c, &arg);
+	for(i = 0; ; i++) {
+		d->path = i ? g_strdup_printf("%s/%s.%d", dir, name, i)
+			: g_build_filename(dir, name, NULL);
+		d->part = g_strconcat(d->path, ".part", NULL);
+		d->state = g_strconcat(d->part, ".state", NULL);
+		if(downloadresume(d))
+			break;
+		if(!g_file_test(d->path, G_FILE_TEST_EXISTS)
+				&& !g_file_test(d->part, G_FILE_TEST_EXISTS)) {
+			d->fd = open(d->part, O_WRONLY | O_CREAT | O_EXCL
+					| O_CLOEXEC, 0600);
+			d->nseg = 1;
+			d->seg[0].d = d;
+			d->seg[0].buf = g_byte_array_new();
+			d->seg[0].end = -1;
+			break;
+		}
+		g_free(d->path);
+		g_free(d->part);
+		g_free(d->state);
+	}
+
+	if(tlsthread && g_str_has_prefix(d->uri, "https://"))
+		tlswait();
+	if(d->fd != -1) {
+		for(i = 0; i < d->nseg; i++) {
+			if(!d->seg[i].done)
+				downloadstart(&d->seg[i]);
+		}
+	} else {
+		d->failed = TRUE;
+	}
+	if(d->active == 0)
+		downloaddone(d);
+	else if(d->c)
+		updatetitle(d->c);
 }
 
+/*
+ * Downloads into downloaddir, or where downloadprompt says, on our own
+ * session, sharing its connections, cookies and TLS setup with the pages.
+ */
 static gboolean
 initdownload(WebKitWebView *view, WebKitDownload *o, Client *c) {
-	Arg arg;
+	WebKitWebSettings *settings = webkit_web_view_get_settings(view);
+	const char *suggested = webkit_download_get_suggested_filename(o);
+	Arg prompt;
+	char *dir, *name, *path;
+	Download *d;
+	GIOChannel *ch;
+	int out;
+
+	d = g_new0(Download, 1);
+	d->c = c;
+	d->uri = g_strdup(webkit_download_get_uri(o));
+	d->referer = g_strdup(geturi(c));
+	d->size = -1;
+	d->fd = -1;
+	g_object_get(G_OBJECT(settings), "user-agent", &d->useragent, NULL);
+	/* from here on it keeps the process alive, see downloaddone() */
+	downloads = g_slist_prepend(downloads, d);
+
+	name = g_path_get_basename(suggested && *suggested ? suggested
+			: d->uri);
+	if(!*name || name[0] == '.' || name[0] == '/') {
+		g_free(name);
+		name = g_strdup("download");
+	}
+	dir = expandpath(downloaddir);
+	g_mkdir_with_parents(dir, 0700);
+
+	path = g_build_filename(dir, name, NULL);
+	prompt = (Arg)DOWNLOADPROMPT(path);
+	if(downloadask && g_spawn_async_with_pipes(NULL, (char **)prompt.v,
+				NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL,
+				NULL, &out, NULL, NULL)) {
+		d->answer = g_string_new(NULL);
+		ch = g_io_channel_unix_new(out);
+		g_io_channel_set_close_on_unref(ch, TRUE);
+		g_io_add_watch(ch, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				(GIOFunc)downloadasked, d);
+		g_io_channel_unref(ch);
+		updatetitle(c);
+	} else {
+		downloadbegin(d, dir, name);
+	}
+	g_free(path);
+	g_free(dir);
+	g_free(name);
 
-	updatewinid(c);
-	arg = (Arg)DOWNLOAD((char *)webkit_download_get_uri(o), geturi(c));
-	spawn(c, &arg);
+	/* WebKit is not to download it itself */
 	return FALSE;
 }
 
@@ -767,20 +3426,45 @@ loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c) {
 	WebKitWebFrame *frame;
 	WebKitWebDataSource *src;
 	WebKitNetworkRequest *request;
-	WebKitWebSettings *set = webkit_web_view_get_settings(c->view);
 	SoupMessage *msg;
 	char *uri;
 
 	switch(webkit_web_view_get_load_status (c->view)) {
+	case WEBKIT_LOAD_PROVISIONAL:
+		trace("load_provisional", 'i');
+		memset(&c->load, 0, sizeof(c->load));
+		c->load.start = g_get_monotonic_time();
+		harstart(c);
+		break;
 	case WEBKIT_LOAD_FIRST_VISUALLY_NON_EMPTY_LAYOUT:
+		trace("load_first_visual_layout", 'i');
+		if(!c->load.visual)
+			c->load.visual = g_get_monotonic_time();
+		if(!hasvisual && spawntime) {
+			fprintf(stderr, "surf: spawn to first visual layout: "
+					"%.1f ms (%s)\n",
+					(g_get_monotonic_time() - spawntime) / 1000.0,
+					zygotechild ? "zygote" : "exec");
+		}
 		hasvisual = true;
 		break;
 	case WEBKIT_LOAD_COMMITTED:
+		trace("load_committed", 'i');
+		c->load.commit = g_get_monotonic_time();
 		uri = geturi(c);
 		if (strcmp(uri, "about:blank") != 0) {
 			origin_uri = uri;
+			g_free(originstat);
+			originstat = NULL;
+			if(c->discarded && strcmp(uri, c->discarduri)) {
+				/* navigated elsewhere meanwhile */
+				c->discarded = FALSE;
+				g_free(c->discarduri);
+				c->discarduri = NULL;
+			}
 		}
-		if(strstr(uri, "https://") == uri) {
+		/* an emptied page was not fetched, it keeps what it had */
+		if(!c->discarded && strstr(uri, "https://") == uri) {
 			frame = webkit_web_view_get_main_frame(c->view);
 			src = webkit_web_frame_get_data_source(frame);
 			request = webkit_web_data_source_get_request(src);
@@ -790,19 +3474,35 @@ loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c) {
 		}
 		setatom(c, AtomUri, uri);
 
-		if(enablestyles) {
-			g_object_set(G_OBJECT(set), "user-stylesheet-uri",
-					getstyle(uri), NULL);
-		}
+		if(enablestyles)
+			setstyle(c, getstyle(uri));
 		break;
 	case WEBKIT_LOAD_FINISHED:
+		trace("load_finished", 'i');
 		c->progress = 100;
-		updatetitle(c);
-		if(diskcache) {
-			soup_cache_flush(diskcache);
-			soup_cache_dump(diskcache);
+		updatestat(c);
+		if(c->restorey >= 0) {
+			gtk_adjustment_set_value(
+					gtk_scrolled_window_get_vadjustment(
+						GTK_SCROLLED_WINDOW(c->scroll)),
+					c->restorey);
+			c->restorey = -1;
+		}
+		if(c->discarded)
+			discardcollect(c);
+		metricswrite(c);
+		harwrite(c);
+		sessionsave(c);
+		/* batch the flushes of loads finishing close to each other */
+		if(diskcache && !cacheflushid) {
+			cacheflushid = g_timeout_add_seconds_full(G_PRIORITY_LOW,
+					diskcacheflush, cacheflush, NULL, NULL);
 		}
 		break;
+	case WEBKIT_LOAD_FAILED:
+		c->load.start = 0;
+		harwrite(c);
+		break;
 	default:
 		break;
 	}
@@ -853,6 +3553,75 @@ loaduri(Client *c, const Arg *arg, gboolean explicitnavigation) {
 	}
 }
 
+/*
+ * Appends a line about the load which just finished to the metrics file of
+ * its origin: the time, milliseconds from the start of the load to its
+ * commit, first visual layout and end, the requests made and bytes
+ * received, the Navigation Timing of the page (dns, connect, first byte,
+ * response, dom ready and load event, -1 where unknown), and the uri.
+ */
+static void
+metricswrite(Client *c) {
+	Load *l = &c->load;
+	gint64 end = g_get_monotonic_time();
+	char *origin, *name, *path, *old, *timing, *site;
+	WebKitWebFrame *frame;
+	const char *uri;
+	struct stat st;
+	FILE *f;
+
+	if(!l->start || !recordmetrics)
+		return;
+	uri = geturi(c);
+	if(!(uriclassify(uri) & UriWeb) || !(origin = origingetfolder(uri))) {
+		l->start = 0;
+		return;
+	}
+
+	frame = webkit_web_view_get_main_frame(c->view);
+	timing = evalstring(webkit_web_frame_get_global_context(frame),
+			"(function(t) {"
+			"function d(a, b) { return a && b >= a ? b - a : -1; }"
+			"return [d(t.domainLookupStart, t.domainLookupEnd),"
+			"d(t.connectStart, t.connectEnd),"
+			"d(t.requestStart, t.responseStart),"
+			"d(t.responseStart, t.responseEnd),"
+			"d(t.navigationStart, t.domContentLoadedEventEnd),"
+			"d(t.navigationStart, t.loadEventEnd)].join(' ');"
+			"})(window.performance.timing)");
+
+	name = g_strdup_printf(originmetricsfile, origin);
+	path = buildpath(name);
+	/* one older file is kept, so the history stays bounded */
+	if(!stat(path, &st) && st.st_size >= metricsbytes) {
+		old = g_strconcat(path, ".old", NULL);
+		g_rename(path, old);
+		g_free(old);
+	}
+	/* not the path or query, which may say more than the timings need */
+	site = origingeturi(uri);
+	if((f = fopen(path, "a"))) {
+		fprintf(f, "%ld %ld %ld %ld %u %" G_GINT64_FORMAT " %s %s\n",
+				(long)time(NULL),
+				l->commit ? (long)(l->commit - l->start) / 1000
+				: -1L,
+				l->visual ? (long)(l->visual - l->start) / 1000
+				: -1L,
+				(long)(end - l->start) / 1000, l->requests,
+				l->bytes,
+				timing ? timing : "-1 -1 -1 -1 -1 -1",
+				site ? site : "-");
+		fclose(f);
+	}
+	l->start = 0;
+
+	g_free(site);
+	g_free(path);
+	g_free(name);
+	g_free(timing);
+	g_free(origin);
+}
+
 static void
 navigate(Client *c, const Arg *arg) {
 	int steps = *(int *)arg;
@@ -869,11 +3638,13 @@ newclient(void) {
 	gdouble dpi;
 	char *ua;
 
+	trace("newclient", 'B');
 	if(!(c = calloc(1, sizeof(Client))))
 		die("Cannot malloc!\n");
 
 	c->title = NULL;
 	c->progress = 100;
+	c->restorey = -1;
 	hasloaded = false;
 
 	/* Window */
@@ -900,6 +3671,18 @@ newclient(void) {
 	g_signal_connect(G_OBJECT(c->win),
 			"destroy",
 			G_CALLBACK(destroywin), c);
+	g_signal_connect(G_OBJECT(c->win),
+			"focus-in-event",
+			G_CALLBACK(sessionfocus), c);
+	g_signal_connect(G_OBJECT(c->win),
+			"focus-out-event",
+			G_CALLBACK(sessionfocus), c);
+	g_signal_connect(G_OBJECT(c->win),
+			"map-event",
+			G_CALLBACK(visibilitychange), c);
+	g_signal_connect(G_OBJECT(c->win),
+			"unmap-event",
+			G_CALLBACK(visibilitychange), c);
 	g_signal_connect(G_OBJECT(c->win),
 			"leave_notify_event",
 			G_CALLBACK(titlechangeleave), c);
@@ -915,7 +3698,9 @@ newclient(void) {
 	gtk_paned_pack1(GTK_PANED(c->pane), c->vbox, TRUE, TRUE);
 
 	/* Webview */
+	trace("webview", 'B');
 	c->view = WEBKIT_WEB_VIEW(webkit_web_view_new());
+	trace("webview", 'E');
 
 	g_signal_connect(G_OBJECT(c->view),
 			"notify::title",
@@ -959,6 +3744,9 @@ newclient(void) {
 	g_signal_connect(G_OBJECT(c->view),
 			"resource-request-starting",
 			G_CALLBACK(beforerequest), c);
+	g_signal_connect(G_OBJECT(c->view),
+			"resource-content-length-received",
+			G_CALLBACK(contentlength), c);
 	g_signal_connect(G_OBJECT(c->view),
 			"should-show-delete-interface-for-element",
 			G_CALLBACK(deletion_interface), c);
@@ -991,7 +3779,9 @@ newclient(void) {
 	gtk_widget_show(c->vbox);
 	gtk_widget_show(c->scroll);
 	gtk_widget_show(GTK_WIDGET(c->view));
+	trace("show", 'B');
 	gtk_widget_show(c->win);
+	trace("show", 'E');
 	gtk_window_set_geometry_hints(GTK_WINDOW(c->win), NULL, &hints,
 			GDK_HINT_MIN_SIZE);
 	gdk_window_set_events(GTK_WIDGET(c->win)->window, GDK_ALL_EVENTS_MASK);
@@ -1009,10 +3799,8 @@ newclient(void) {
 	if(!(ua = getenv("SURF_USERAGENT")))
 		ua = useragent;
 	g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
-	if (enablestyles) {
-		g_object_set(G_OBJECT(settings), "user-stylesheet-uri",
-					 getstyle("about:blank"), NULL);
-	}
+	if (enablestyles)
+		setstyle(c, getstyle("about:blank"));
 	g_object_set(G_OBJECT(settings), "auto-load-images", loadimages,
 			NULL);
 	g_object_set(G_OBJECT(settings), "enable-plugins", enableplugins,
@@ -1090,15 +3878,19 @@ newclient(void) {
                 }
 	}
 
+	controllisten(c);
+
+	trace("newclient", 'E');
 	return c;
 }
 
 static void
 newwindow(Client *c, const Arg *arg, gboolean noembed, gboolean explicitnavigation) {
+	Client *p;
 	guint i = 0;
 	const char *cmd[22], *uri;
 	const Arg a = { .v = (void *)cmd };
-	char tmp[64];
+	char tmp[64], stime[32];
 	char *origin_packed = NULL;
 
 	cmd[i++] = argv0;
@@ -1143,9 +3935,33 @@ newwindow(Client *c, const Arg *arg, gboolean noembed, gboolean explicitnavigati
 	if(uri)
 		cmd[i++] = uri;
 	cmd[i++] = NULL;
-	spawn(NULL, &a);
+	if(getenv("SURF_BENCH")) {
+		snprintf(stime, LENGTH(stime), "%" G_GINT64_FORMAT,
+				g_get_monotonic_time());
+		g_setenv("SURF_SPAWNTIME", stime, TRUE);
+	}
+	trace("newwindow", 'i');
+	if(!brokeropen(uri, (char *const *)cmd)
+			&& !zygotespawn((char *const *)cmd))
+		spawn(NULL, &a);
+	/* for that child alone, not the ones spawned later */
+	g_unsetenv("SURF_SPAWNTIME");
 	g_free(origin_packed);
 	if (!hasvisual) {
+		if(clients) {
+			controldrain(clients);
+			sessionforget(clients);
+		}
+		/* the downloads still running finish first, windowless */
+		if(downloads) {
+			for(p = clients; p; p = p->next) {
+				gtk_widget_hide(p->win);
+				g_idle_add((GSourceFunc)destroyidle, p);
+			}
+			return;
+		}
+		if(cacheflushid)
+			cacheflush(NULL);
 		if(dpy)
 			close(ConnectionNumber(dpy));
 
@@ -1203,109 +4019,157 @@ menuactivate(GtkMenuItem *item, Client *c) {
 
 static int
 origincmp(const char *uri1, const char *uri2) {
-	/* Doesn't handle default ports, but otherwise should comply with RFC 6454, The Web Origin Concept. */
-	int c;
-	if        (g_str_has_prefix(uri1, "http://")  && g_str_has_prefix(uri2, "http://")) {
-		return strncmp(uri1 + strlen("http://"),  uri2 + strlen("http://"),  strcspn(uri1 + strlen("http://"),  "/?#"));
-	} else if (g_str_has_prefix(uri1, "https://") && g_str_has_prefix(uri2, "https://")) {
-		return strncmp(uri1 + strlen("https://"), uri2 + strlen("https://"), strcspn(uri1 + strlen("https://"), "/?#"));
-	} else {
-		c = strcmp(uri1, uri2);
-		if (c == 0) {
-			/* -1 when 0 to force a mismatch in originmatch() */
-			c = -1;
-		}
-		return c;
-	}
-}
+	const Origin *o1 = originget(uri1), *o2 = originget(uri2);
 
-static int
-originhas(const char *uri) {
-	char *origin = origingethost(uri);
-	int has = origin != NULL;
-	free(origin);
-	return has;
+	/* interned, and a uri without an origin matches nothing */
+	if(o1 && o1 == o2)
+		return 0;
+	if(!o1 || !o2)
+		return -1;
+	return strcmp(o1->uri, o2->uri);
 }
 
-static const char *
-origingetproto(const char *uri) {
-	if (g_str_has_prefix(uri, "http://")) {
-		return "http";
-	} else if (g_str_has_prefix(uri, "https://")) {
-		return "https";
-	} else {
+/*
+ * Returns the origin of uri as of RFC 6454, The Web Origin Concept, or NULL
+ * for uris which have no origin other than a globally unique one. Origins
+ * are interned and never freed, so the same origin is the same pointer.
+ */
+static const Origin *
+originget(const char *uri) {
+	static GHashTable *origins = NULL;
+	static char *lasturi = NULL;
+	static const Origin *last = NULL;
+	const char *scheme, *p, *host, *port;
+	char authority[512], key[sizeof(authority) + 8];
+	size_t n, hostlen, portlen;
+	guint64 portnum;
+	Origin *o;
+
+	if(!uri)
 		return NULL;
-	}
-}
-
-/* caller must free() the return value, if not NULL */
-static char *
-origingethost(const char *uri) {
-	/* Doesn't handle default ports, but otherwise should comply with RFC 6454, The Web Origin Concept. */
-	char  *origin = NULL;
-	size_t spansize;
-	size_t spanstart;
-
-	if (       g_str_has_prefix(uri, "http://")) {
-		spanstart =       strlen("http://");
-	} else if (g_str_has_prefix(uri, "https://")) {
-		spanstart =       strlen("https://");
+	if(lasturi && !strcmp(uri, lasturi))
+		return last;
+
+	if(!g_ascii_strncasecmp(uri, "http://", 7)) {
+		scheme = "http";
+		p = uri + 7;
+	} else if(!g_ascii_strncasecmp(uri, "https://", 8)) {
+		scheme = "https";
+		p = uri + 8;
 	} else {
-		/* 
-		 * RFC 6454: this case should return a globally unique origin. 
+		/*
+		 * RFC 6454: this case should return a globally unique origin.
 		 *
 		 * As long as processes are per-origin
 		 * (that is, new origins get a new process),
 		 * then relying only on process state provides this uniqueness,
-		 * since anything stored would be stored by an inaccessible key. 
+		 * since anything stored would be stored by an inaccessible key.
 		 *
 		 * So, when the caller gets this error,
 		 * it should just bypass storage altogether.
 		 */
-		return NULL;
+		o = NULL;
+		goto out;
 	}
 
-	spansize = strcspn(uri + spanstart, "/?#");
-	if (spansize > 0 && uri[spanstart] == '.') {
-		/* kill attempt to traverse into parent folder */
-		return NULL;
-	}
-	origin = malloc(sizeof(char) * (spansize + 1));
-	if (origin) {
-		strncpy(origin, uri + spanstart, spansize);
-		origin[spansize] = '\0';
-		/* malloc()'d origin */
-		return origin;
+	/* authority, without userinfo */
+	n = strcspn(p, "/?#");
+	for(host = p + n; host > p && host[-1] != '@'; host--);
+	n -= host - p;
+
+	if(host[0] == '[') {
+		/* IPv6 literal */
+		hostlen = 1 + strspn(host + 1, "0123456789abcdefABCDEF:.");
+		if(hostlen >= n || host[hostlen] != ']') {
+			o = NULL;
+			goto out;
+		}
+		hostlen++;
 	} else {
-		/* ENOMEM set by malloc() */
-		return NULL;
+		hostlen = strcspn(host, ":/?#");
+		if(hostlen > n)
+			hostlen = n;
+	}
+	port = host + hostlen;
+	portlen = n - hostlen;
+	if(portlen > 0) {
+		/* skip the colon */
+		port++;
+		portlen--;
+	}
+
+	/* empty, or an attempt to traverse into a parent folder */
+	o = NULL;
+	if(hostlen == 0 || host[0] == '.' || hostlen + 8 >= sizeof(authority)
+			|| strspn(port, "0123456789") < portlen)
+		goto out;
+	portnum = portlen ? g_ascii_strtoull(port, NULL, 10) : 0;
+	if(portlen > 5 || portnum > 65535)
+		goto out;
+	if(portnum == (scheme[4] ? 443 : 80))
+		portnum = 0;
+
+	for(n = 0; n < hostlen; n++)
+		authority[n] = g_ascii_tolower(host[n]);
+	if(portnum)
+		g_snprintf(authority + n, sizeof(authority) - n, ":%u",
+				(guint)portnum);
+	else
+		authority[n] = '\0';
+
+	g_snprintf(key, sizeof(key), "%s://%s", scheme, authority);
+	if(!origins)
+		origins = g_hash_table_new(g_str_hash, g_str_equal);
+	if(!(o = g_hash_table_lookup(origins, key))) {
+		o = g_new0(Origin, 1);
+		o->scheme = scheme;
+		o->host = g_strdup(authority);
+		o->uri = g_strdup(key);
+		o->folder = g_strdup_printf("%s_%s", scheme, authority);
+		g_hash_table_insert(origins, o->uri, o);
 	}
+
+out:
+	g_free(lasturi);
+	lasturi = g_strdup(uri);
+	last = o;
+	return o;
+}
+
+static int
+originhas(const char *uri) {
+	return originget(uri) != NULL;
+}
+
+static const char *
+origingetproto(const char *uri) {
+	const Origin *o = originget(uri);
+
+	return o ? o->scheme : NULL;
+}
+
+/* caller must g_free() the return value, if not NULL */
+static char *
+origingethost(const char *uri) {
+	const Origin *o = originget(uri);
+
+	return o ? g_strdup(o->host) : NULL;
 }
 
 /* caller must g_free() the return value, if not NULL */
 static char *
 origingeturi(const char *uri) {
-	const char *origin_proto = origingetproto(uri);
-	char *origin_host = origingethost(uri);
-	char *origin_packed = NULL;
-	if (origin_host) {
-		origin_packed = g_strdup_printf("%s://%s", origin_proto, origin_host);
-	}
-	g_free(origin_host);
-	return origin_packed;
+	const Origin *o = originget(uri);
+
+	return o ? g_strdup(o->uri) : NULL;
 }
 
 /* caller must g_free() the return value, if not NULL */
 static char *
 origingetfolder(const char *uri) {
-	const char *origin_proto = origingetproto(uri);
-	char *origin_host = origingethost(uri);
-	char *origin_packed = NULL;
-	if (origin_host) {
-		origin_packed = g_strdup_printf("%s_%s", origin_proto, origin_host);
-	}
-	g_free(origin_host);
-	return origin_packed;
+	const Origin *o = originget(uri);
+
+	return o ? g_strdup(o->folder) : NULL;
 }
 
 static int
@@ -1313,6 +4177,27 @@ originmatch(const char *uri1, const char *uri2) {
 	return origincmp(uri1, uri2) == 0;
 }
 
+/*
+ * Loads uri into a fresh client, asking the user first when the uri was
+ * reached by crossing over from another origin.
+ */
+static void
+openuri(Client *c, const char *uri, const char *referrer) {
+	Arg arg;
+	char *prompt;
+
+	if (sameoriginpolicy && referrer && (strcmp(referrer, "-") == 0 || !originmatch(referrer, uri))) {
+		setatom(c, AtomUri, uri);
+		prompt = g_strdup_printf(PROMPT_ORIGIN, referrer);
+		arg = (Arg)SETPROP("_SURF_URI", "_SURF_GO", prompt);
+		spawn(c, &arg);
+		g_free(prompt);
+	} else {
+		arg.v = uri;
+		loaduri(c, &arg, 0);
+	}
+}
+
 static void
 pasteuri(GtkClipboard *clipboard, const char *text, gpointer d) {
 	char *qualified_uri = qualify_uri(text);
@@ -1322,6 +4207,41 @@ pasteuri(GtkClipboard *clipboard, const char *text, gpointer d) {
 	g_free(qualified_uri);
 }
 
+/* SURF_STATS: what this process did, printed when it exits */
+static void
+printstats(void) {
+	gint64 bgwall, bgcpu;
+	guint hits = cachestats.requests > cachestats.network ?
+		cachestats.requests - cachestats.network : 0;
+	guint64 cachebytes = cachestats.bytes > cachestats.networkbytes ?
+		cachestats.bytes - cachestats.networkbytes : 0;
+
+	fprintf(stderr, "surf[%d]: cache: %u requests, %u hits, %u misses, "
+			"%u revalidations, %" G_GUINT64_FORMAT " of %"
+			G_GUINT64_FORMAT " bytes served from cache\n",
+			(int)getpid(), cachestats.requests, hits,
+			cachestats.network - cachestats.revalidations,
+			cachestats.revalidations, cachebytes, cachestats.bytes);
+	fprintf(stderr, "surf[%d]: title: %u updates, %u coalesced, "
+			"%u set\n", (int)getpid(), titlestats.updates,
+			titlestats.coalesced, titlestats.set);
+	fprintf(stderr, "surf[%d]: x: %u property writes in %u flushes, "
+			"%u round trips\n", (int)getpid(), xstats.writes,
+			xstats.flushes, xstats.roundtrips);
+	/* including the span the process is in now */
+	bgwall = bgstats.wall;
+	bgcpu = bgstats.cpu;
+	if(bgstats.since) {
+		bgwall += g_get_monotonic_time() - bgstats.since;
+		bgcpu += cputime();
+	}
+	fprintf(stderr, "surf[%d]: background: %.1f s, %.1f ms cpu "
+			"(%.2f%%)\n", (int)getpid(),
+			bgwall / (double)G_USEC_PER_SEC,
+			bgcpu / 1000.0, bgwall ?
+			100.0 * bgcpu / bgwall : 0.0);
+}
+
 static void
 print(Client *c, const Arg *arg) {
 	webkit_web_frame_print(webkit_web_view_get_main_frame(c->view));
@@ -1332,11 +4252,23 @@ processx(GdkXEvent *e, GdkEvent *event, gpointer d) {
 	Client *c = (Client *)d;
 	XPropertyEvent *ev;
 	Arg arg;
+	int i;
 	const char *unqualified_uri = NULL;
 	char *qualified_uri = NULL;
 
 	if(((XEvent *)e)->type == PropertyNotify) {
 		ev = &((XEvent *)e)->xproperty;
+		for(i = 0; i < AtomLast; i++) {
+			if(ev->atom != atoms[i])
+				continue;
+			/* our own writes leave what we know valid */
+			if(c->atomechoes[i] > 0) {
+				c->atomechoes[i]--;
+			} else if(!(c->atomdirty & 1 << i)) {
+				g_free(c->atomval[i]);
+				c->atomval[i] = NULL;
+			}
+		}
 		if(ev->state == PropertyNewValue) {
 			if(ev->atom == atoms[AtomFind]) {
 				arg.b = TRUE;
@@ -1422,29 +4354,305 @@ scroll(GtkAdjustment *a, const Arg *arg) {
 	gtk_adjustment_set_value(a, v);
 }
 
+/* most recently used first */
+static int
+sessionentrycmp(gconstpointer a, gconstpointer b) {
+	const SessionEntry *ea = *(SessionEntry **)a;
+	const SessionEntry *eb = *(SessionEntry **)b;
+
+	return (eb->used > ea->used) - (eb->used < ea->used);
+}
+
+/*
+ * The entry of the last focused window is the newest. Leaving a window
+ * saves it too, but keeps its time, or it might tie with the next one.
+ */
+static gboolean
+sessionfocus(GtkWidget *w, GdkEventFocus *e, Client *c) {
+	struct timespec ts[2];
+	struct stat st;
+	char *path;
+
+	path = e->in ? NULL : sessionpath(c);
+	if(path && stat(path, &st)) {
+		g_free(path);
+		path = NULL;
+	}
+	sessionsave(c);
+	if(path) {
+		ts[0] = st.st_atim;
+		ts[1] = st.st_mtim;
+		utimensat(AT_FDCWD, path, ts, 0);
+		g_free(path);
+	}
+	return FALSE;
+}
+
+static void
+sessionforget(Client *c) {
+	char *path;
+
+	if((path = sessionpath(c))) {
+		g_unlink(path);
+		g_free(path);
+	}
+}
+
+/*
+ * Reads the session entry at path, and removes it; the window restoring it
+ * makes one of its own. Toggles of the process are set here, those of the
+ * window are left in restoretoggles for main() to apply to its client
+ * alone, so windows later opened through the broker keep the defaults.
+ * Returns the uri to load.
+ */
+static char *
+sessionload(const char *path) {
+	char *contents, **lines, *uri = NULL, *t;
+
+	if(!g_file_get_contents(path, &contents, NULL, NULL))
+		return NULL;
+	g_unlink(path);
+	lines = g_strsplit(contents, "\n", 5);
+	g_free(contents);
+
+	if(lines[0] && *lines[0])
+		uri = g_strdup(lines[0]);
+	if(lines[0] && lines[1] && lines[2] && lines[3] && *lines[3]) {
+		restorey = g_ascii_strtod(lines[1], NULL);
+		restorezoom = g_ascii_strtod(lines[2], NULL);
+		t = lines[3];
+		allowgeolocation = strchr(t, 'G') != NULL;
+		enablediskcache = strchr(t, 'D') != NULL;
+		sameoriginpolicy = strchr(t, 'O') != NULL;
+		enablestyles = strchr(t, 'M') != NULL;
+		restoretoggles = g_strdup(t);
+	}
+	g_strfreev(lines);
+
+	return uri;
+}
+
+/* caller must g_free() the return value, if not NULL */
+static char *
+sessionpath(Client *c) {
+	if(!sessiondir || !c->win || !GTK_WIDGET(c->win)->window)
+		return NULL;
+	return g_strdup_printf("%s/%u", sessiondir,
+			(guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
+}
+
+static gboolean
+sessionplaceholderfocus(GtkWidget *w, GdkEventFocus *e, gpointer d) {
+	sessionspawn(g_object_get_data(G_OBJECT(w), "entry"));
+	gtk_widget_destroy(w);
+	return TRUE;
+}
+
+static void
+sessionplaceholdergone(GtkWidget *w, gpointer d) {
+	placeholders = g_slist_remove(placeholders, w);
+	if(!placeholders)
+		gtk_main_quit();
+}
+
+/*
+ * Restores the windows of the last session. The window focused last loads
+ * right away, the others wait as placeholders until they are focused, or
+ * are started one every sessionrestoredelay seconds.
+ */
+static void
+sessionrestore(void) {
+	GPtrArray *entries;
+	SessionEntry *e;
+	GtkWidget *w;
+	const char *name;
+	char *dir, *contents;
+	struct stat st;
+	GDir *d;
+	guint i;
+
+	gtk_init(NULL, NULL);
+	/* setup() is not run here, the windows started are reaped all the same */
+	sigchld(0);
+	dir = expandpath(sessionfolder);
+	if(!(d = g_dir_open(dir, 0, NULL))) {
+		g_free(dir);
+		return;
+	}
+	entries = g_ptr_array_new();
+	while((name = g_dir_read_name(d))) {
+		e = g_new0(SessionEntry, 1);
+		e->path = g_build_filename(dir, name, NULL);
+		if(stat(e->path, &st) || !S_ISREG(st.st_mode)
+				|| !g_file_get_contents(e->path, &contents,
+					NULL, NULL)) {
+			g_free(e->path);
+			g_free(e);
+			continue;
+		}
+		e->uri = g_strndup(contents, strcspn(contents, "\n"));
+		e->used = st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000)
+			+ st.st_mtim.tv_nsec;
+		g_free(contents);
+		g_ptr_array_add(entries, e);
+	}
+	g_dir_close(d);
+	g_free(dir);
+	g_ptr_array_sort(entries, sessionentrycmp);
+
+	for(i = 0; i < entries->len; i++) {
+		e = g_ptr_array_index(entries, i);
+		if(i == 0) {
+			sessionspawn(e->path);
+		} else {
+			w = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+			gtk_window_set_title(GTK_WINDOW(w), e->uri);
+			gtk_window_set_wmclass(GTK_WINDOW(w), "surf", "Surf");
+			gtk_window_set_default_size(GTK_WINDOW(w), 800, 600);
+			/* or they would all be started as they appear */
+			gtk_window_set_focus_on_map(GTK_WINDOW(w), FALSE);
+			gtk_container_add(GTK_CONTAINER(w),
+					gtk_label_new(e->uri));
+			g_object_set_data_full(G_OBJECT(w), "entry",
+					g_strdup(e->path), g_free);
+			g_signal_connect(G_OBJECT(w), "focus-in-event",
+					G_CALLBACK(sessionplaceholderfocus),
+					NULL);
+			g_signal_connect(G_OBJECT(w), "destroy",
+					G_CALLBACK(sessionplaceholdergone),
+					NULL);
+			gtk_widget_show_all(w);
+			placeholders = g_slist_append(placeholders, w);
+		}
+		g_free(e->path);
+		g_free(e->uri);
+		g_free(e);
+	}
+	g_ptr_array_free(entries, TRUE);
+
+	if(placeholders) {
+		if(sessionrestoredelay) {
+			g_timeout_add_seconds(sessionrestoredelay,
+					sessionrestorenext, NULL);
+		}
+		gtk_main();
+	}
+}
+
+/* starts the next placeholder in the background */
+static gboolean
+sessionrestorenext(gpointer d) {
+	GtkWidget *w;
+
+	if(!placeholders)
+		return FALSE;
+	w = placeholders->data;
+	sessionspawn(g_object_get_data(G_OBJECT(w), "entry"));
+	gtk_widget_destroy(w);
+
+	return placeholders != NULL;
+}
+
+/*
+ * Records the uri, scroll position, zoom and toggles of c in its session
+ * entry, which is removed again when the user closes the window.
+ */
+static void
+sessionsave(Client *c) {
+	GtkAdjustment *a;
+	char *path, *entry;
+	char y[G_ASCII_DTOSTR_BUF_SIZE], zoom[G_ASCII_DTOSTR_BUF_SIZE];
+	const char *uri = geturi(c);
+
+	if(!*uri || !strcmp(uri, "about:blank") || !(path = sessionpath(c)))
+		return;
+
+	gettogglestat(c);
+	a = gtk_scrolled_window_get_vadjustment(
+			GTK_SCROLLED_WINDOW(c->scroll));
+	/* an emptied page is not scrolled, it remembers where it was */
+	g_ascii_dtostr(y, sizeof(y), c->discarded ? c->discardy
+			: gtk_adjustment_get_value(a));
+	g_ascii_dtostr(zoom, sizeof(zoom),
+			webkit_web_view_get_zoom_level(c->view));
+	entry = g_strdup_printf("%s\n%s\n%s\n%s\n", uri, y, zoom,
+			c->togglestat);
+	g_file_set_contents(path, entry, -1, NULL);
+	g_free(entry);
+	g_free(path);
+}
+
+static void
+sessionspawn(const char *path) {
+	char *cmd[] = { argv0, "-l", (char *)path, NULL };
+	Arg a = { .v = cmd };
+
+	if(!zygotespawn((char *const *)cmd))
+		spawn(NULL, &a);
+}
+
+/* on SIGTERM the windows are kept for the next session */
+static gboolean
+sessionterm(gpointer d) {
+	Client *c;
+
+	quitting = TRUE;
+	for(c = clients; c; c = c->next)
+		sessionsave(c);
+	gtk_main_quit();
+
+	return FALSE;
+}
+
+/*
+ * Queues v to be written to property a of the window of c. The writes are
+ * sent together once the main loop is idle, replacing each other if the
+ * same property is set twice, and never wait for the X server. spawn()
+ * sends them right away, for the child to see.
+ */
 static void
 setatom(Client *c, int a, const char *v) {
-	XSync(dpy, False);
-	XChangeProperty(dpy, GDK_WINDOW_XID(GTK_WIDGET(c->win)->window),
-			atoms[a], XA_STRING, 8, PropModeReplace,
-			(unsigned char *)v, strlen(v) + 1);
-	XSync(dpy, False);
+	if(c->atomval[a] && !strcmp(c->atomval[a], v))
+		return;
+	g_free(c->atomval[a]);
+	c->atomval[a] = g_strdup(v);
+	c->atomdirty |= 1 << a;
+	if(!c->atomid) {
+		c->atomid = g_idle_add_full(GDK_PRIORITY_REDRAW + 1,
+				(GSourceFunc)atomflush, c, NULL);
+	}
+}
+
+static void
+setstyle(Client *c, const char *style) {
+	WebKitWebSettings *settings;
+
+	/* setting it again would restyle the whole page */
+	if(c->style == style)
+		return;
+	c->style = style;
+	settings = webkit_web_view_get_settings(c->view);
+	g_object_set(G_OBJECT(settings), "user-stylesheet-uri", style, NULL);
 }
 
 static void
 setup(const char *qualified_uri) {
-	int i;
 	char *proxy;
 	char *new_proxy;
 	char *origin;
 	char *originpath;
+	char *path;
+	guint cachefactor = 1;
 	SoupURI *puri;
 	SoupSession *s;
-	GError *error = NULL;
 
-	/* clean up any zombies immediately */
-	sigchld(0);
+	trace("setup", 'B');
+	/* a zygote child has done this before forking */
+	if(!zygotechild)
+		setupshared();
+	trace("gtk_init", 'B');
 	gtk_init(NULL, NULL);
+	trace("gtk_init", 'E');
 
 	dpy = GDK_DISPLAY();
 
@@ -1454,6 +4662,7 @@ setup(const char *qualified_uri) {
 	atoms[AtomUri] = XInternAtom(dpy, "_SURF_URI", False);
 
 	/* dirs and files */
+	trace("buildpath", 'B');
 	if (sameoriginpolicy && qualified_uri && originhas(qualified_uri)) {
 		origin = origingetfolder(qualified_uri);
 
@@ -1469,6 +4678,16 @@ setup(const char *qualified_uri) {
 		dbfolder = buildpath(originpath);
 		g_free(originpath);
 
+		brokerlisten(origin);
+
+		/* often used origins get a larger share of the cache budget */
+		if(enablediskcache) {
+			cachefactor = CLAMP(g_bit_storage(cacheuses(origin)), 1,
+					diskcachehotfactor);
+			g_timeout_add_seconds_full(G_PRIORITY_LOW, 10,
+					cachebudget, NULL, NULL);
+		}
+
 		free(origin);
 	} else {
 		cookiefile = buildpath(cookiefile);
@@ -1477,48 +4696,58 @@ setup(const char *qualified_uri) {
 	}
 
 	scriptfile = buildpath(scriptfile);
-	styledir = buildpath(styledir);
-	if(stylefile == NULL) {
-		for(i = 0; i < LENGTH(styles); i++) {
-			if(regcomp(&(styles[i].re), styles[i].regex,
-						REG_EXTENDED)) {
-				fprintf(stderr,
-					"Could not compile regex: %s\n",
-					styles[i].regex);
-				styles[i].regex = NULL;
-			}
-			styles[i].style = buildpath(
-					g_strconcat(styledir,
-						styles[i].style, NULL));
-		}
-	} else {
-		stylefile = buildpath(stylefile);
+	sessiondir = expandpath(sessionfolder);
+	g_mkdir_with_parents(sessiondir, 0700);
+	g_unix_signal_add(SIGTERM, sessionterm, NULL);
+	if(stylefile != NULL) {
+		/* site styles are compiled on first use, see getstyle() */
+		path = buildpath(stylefile);
+		stylefile = g_strconcat("file://", path, NULL);
+		g_free(path);
+	}
+	trace("buildpath", 'E');
+
+	if(enableblocking) {
+		trace("blocklist", 'B');
+		blockload();
+		trace("blocklist", 'E');
 	}
 
 	/* request handler */
 	s = webkit_get_default_session();
 
 	/* cookie jar */
+	trace("cookiejar", 'B');
 	soup_session_add_feature(s,
 			SOUP_SESSION_FEATURE(cookiejar_new(cookiefile, FALSE,
 					cookiepolicy_get())));
+	trace("cookiejar", 'E');
 
-	/* disk cache */
+	/* disk cache, its index read while the window is built */
 	if(enablediskcache) {
 		diskcache = soup_cache_new(cachefolder, SOUP_CACHE_SINGLE_USER);
-		soup_cache_set_max_size(diskcache, diskcachebytes);
-		soup_cache_load(diskcache);
-		soup_session_add_feature(s, SOUP_SESSION_FEATURE(diskcache));
+		soup_cache_set_max_size(diskcache,
+				diskcachebytes * cachefactor);
+		cachethread = g_thread_new("cacheload", cacheload, NULL);
 	}
+	if((showstats = getenv("SURF_STATS") != NULL)) {
+		g_signal_connect(G_OBJECT(s), "request-started",
+				G_CALLBACK(cacherequest), NULL);
+	}
+	if(getenv("SURF_HAR")) {
+		harsample = *getenv("SURF_HAR") ?
+			g_ascii_strtod(getenv("SURF_HAR"), NULL) : 1;
+	}
+	/* the control command har captures loads without SURF_HAR too */
+	g_signal_connect(G_OBJECT(s), "request-queued",
+			G_CALLBACK(harqueued), NULL);
 
-	/* ssl */
-	tlsdb = g_tls_file_database_new(cafile, &error);
-
-	if(error) {
-		g_warning("Error loading SSL database %s: %s", cafile, error->message);
-		g_error_free(error);
+	/* ssl, parsed while the window is built unless a zygote did it */
+	if(tlsdb) {
+		g_object_set(G_OBJECT(s), "tls-database", tlsdb, NULL);
+	} else {
+		tlsthread = g_thread_new("tlsload", tlsload, NULL);
 	}
-	g_object_set(G_OBJECT(s), "tls-database", tlsdb, NULL);
 	g_object_set(G_OBJECT(s), "ssl-strict", strictssl, NULL);
 
 	/* proxy */
@@ -1531,6 +4760,26 @@ setup(const char *qualified_uri) {
 		g_free(new_proxy);
 		usingproxy = 1;
 	}
+	trace("setup", 'E');
+}
+
+/*
+ * Everything that does not depend on the display or on the origin. A zygote
+ * runs this once and every forked child inherits the result.
+ */
+static void
+setupshared(void) {
+	/* clean up any zombies immediately */
+	sigchld(0);
+
+	/* loads libwebkit and creates the default session */
+	trace("webkit_init", 'B');
+	webkit_get_default_session();
+	trace("webkit_init", 'E');
+
+	/* the parsed SSL database is shared copy-on-write with all children */
+	if(zygote)
+		tlsdb = tlsload(NULL);
 }
 
 static void
@@ -1540,6 +4789,128 @@ sigchld(int unused) {
 	while(0 < waitpid(-1, NULL, WNOHANG));
 }
 
+static int
+sockconnect(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Reads what sockputargv() sent. Both *env and *argv point into the returned
+ * buffer; all three need to be g_free()'d by the caller. Returns NULL on a
+ * malformed message.
+ */
+static char *
+sockgetargv(int fd, char ***env, char ***argv) {
+	char buf[BUFSIZ];
+	ssize_t n;
+	GString *msg = g_string_new(NULL);
+
+	while((n = read(fd, buf, sizeof(buf))) > 0
+			|| (n == -1 && errno == EINTR)) {
+		if(n > 0)
+			g_string_append_len(msg, buf, n);
+	}
+	return sockparseargv(msg, env, argv);
+}
+
+/* splits msg, read in full, as sockgetargv() does; msg is used up */
+static char *
+sockparseargv(GString *msg, char ***env, char ***argv) {
+	char *p, *end;
+	int nenv, i;
+
+	*env = *argv = NULL;
+	if(msg->len == 0 || msg->str[msg->len - 1] != '\0') {
+		g_string_free(msg, TRUE);
+		return NULL;
+	}
+
+	p = msg->str;
+	end = msg->str + msg->len;
+	nenv = atoi(p);
+	p += strlen(p) + 1;
+
+	*env = g_new0(char *, msg->len + 1);
+	for(i = 0; i < nenv && p < end; i++, p += strlen(p) + 1)
+		(*env)[i] = p;
+	*argv = g_new0(char *, msg->len + 1);
+	for(i = 0; p < end; i++, p += strlen(p) + 1)
+		(*argv)[i] = p;
+
+	return g_string_free(msg, FALSE);
+}
+
+/*
+ * Sends env (may be NULL) and argv to the surf listening on path, as
+ * NUL-terminated strings preceded by the number of environment entries.
+ * Returns FALSE when nobody is listening there.
+ */
+static gboolean
+sockputargv(const char *path, char *const *env, char *const *argv) {
+	char n[16];
+	int fd, i;
+	GString *msg;
+	gboolean sent;
+
+	if((fd = sockconnect(path)) == -1)
+		return FALSE;
+
+	msg = g_string_new(NULL);
+	for(i = 0; env && env[i]; i++);
+	snprintf(n, LENGTH(n), "%d", i);
+	g_string_append_len(msg, n, strlen(n) + 1);
+	for(i = 0; env && env[i]; i++)
+		g_string_append_len(msg, env[i], strlen(env[i]) + 1);
+	for(i = 0; argv[i]; i++)
+		g_string_append_len(msg, argv[i], strlen(argv[i]) + 1);
+
+	sent = write(fd, msg->str, msg->len) == (ssize_t)msg->len;
+	close(fd);
+	g_string_free(msg, TRUE);
+
+	return sent;
+}
+
+static int
+socklisten(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	/* a stale socket, or the empty file buildpath() left behind */
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	g_chmod(path, 0600);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
 static void
 source(Client *c, const Arg *arg) {
 	Arg a = { .b = FALSE };
@@ -1550,33 +4921,107 @@ source(Client *c, const Arg *arg) {
 	reload(c, &a);
 }
 
+/* resident set size in kB, or -1 */
+static long
+rsskb(void) {
+	FILE *f;
+	long pages = -1;
+
+	if(!(f = fopen("/proc/self/statm", "r")))
+		return -1;
+	if(fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+
+	return pages == -1 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Starts a command in a session of its own, without our X connection. With
+ * posix_spawn the child does not copy our page tables, which fork() would
+ * have to do for the whole WebKit heap.
+ */
 static void
 spawn(Client *c, const Arg *arg) {
+	char *const *cmd = (char *const *)arg->v;
+	gint64 start = 0;
+#ifdef POSIX_SPAWN_SETSID
+	extern char **environ;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	pid_t pid;
+	int err;
+#endif
+
+	trace("spawn", 'B');
+	if(getenv("SURF_BENCH"))
+		start = g_get_monotonic_time();
+	/* the child may read the properties of c, like SETPROP does */
+	if(c && c->atomid) {
+		g_source_remove(c->atomid);
+		atomflush(c);
+	}
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawn_file_actions_init(&fa);
+	if(dpy)
+		posix_spawn_file_actions_addclose(&fa, ConnectionNumber(dpy));
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+	if((err = posix_spawnp(&pid, cmd[0], &fa, &attr, cmd, environ))) {
+		fprintf(stderr, "surf: execvp %s failed: %s\n", cmd[0],
+				strerror(err));
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+#else
 	if(fork() == 0) {
 		if(dpy)
 			close(ConnectionNumber(dpy));
 		setsid();
-		execvp(((char **)arg->v)[0], (char **)arg->v);
-		fprintf(stderr, "surf: execvp %s", ((char **)arg->v)[0]);
+		execvp(cmd[0], cmd);
+		fprintf(stderr, "surf: execvp %s", cmd[0]);
 		perror(" failed");
 		exit(0);
 	}
+#endif
+	if(start) {
+		fprintf(stderr, "surf: spawn %s: %.3f ms at %ld kB resident\n",
+				cmd[0], (g_get_monotonic_time() - start) / 1000.0,
+				rsskb());
+	}
+	trace("spawn", 'E');
 }
 
+/*
+ * Fills buf from a pool of random bytes, which is refilled by getrandom(2)
+ * when it runs dry, so no file descriptor is ever opened.
+ */
 static int
 strrand(char *buf, int buflen) {
-	int fd;
-	int received;
-
-	fd = g_open("/dev/urandom", O_RDONLY, 0);
-	if (fd == -1) {
-		return -1;
-	}
-	received = read(fd, buf, buflen);
-	if (received != buflen) {
-		return -1;
+	ssize_t n;
+	int len;
+
+	while(buflen > 0) {
+		if(randpos == sizeof(randpool)) {
+			for(len = 0; len < sizeof(randpool); len += n) {
+				n = getrandom(randpool + len,
+						sizeof(randpool) - len, 0);
+				if(n == -1 && errno == EINTR)
+					n = 0;
+				else if(n <= 0)
+					return -1;
+			}
+			randpos = 0;
+		}
+		len = MIN(buflen, sizeof(randpool) - randpos);
+		memcpy(buf, randpool + randpos, len);
+		/* each byte is handed out once */
+		memset(randpool + randpos, 0, len);
+		randpos += len;
+		buf += len;
+		buflen -= len;
 	}
-	return g_close(fd, NULL);
+	return 0;
 }
 
 /* return value must be freed with g_free() */
@@ -1630,18 +5075,25 @@ strlangentropy() {
 	return strname;
 }
 
+/*
+ * The scrambled fingerprint is made once per process, that is per origin,
+ * so sites see it stable and responses varying on it stay cacheable.
+ */
 static void
 acceptlanguagescramble() {
 	SoupSession *s = webkit_get_default_session();
 	char *lang = getenv("LANG");
-	char *randlang1 = strlangentropy();
-	char *randlang2 = strlangentropy();
+	char *randlang1, *randlang2;
 	char *acceptlanguage;
 
-	if (lang != NULL && strlen(lang) >= 5) {
-		acceptlanguage = g_strdup_printf("%5.5s, %s;q=0.9, %s;q=0.8", lang, randlang1, randlang2);
-		g_object_set(G_OBJECT(s), "accept-language", acceptlanguage, NULL);
-	}
+	if (scrambledlanguage || lang == NULL || strlen(lang) < 5)
+		return;
+	scrambledlanguage = TRUE;
+	randlang1 = strlangentropy();
+	randlang2 = strlangentropy();
+	acceptlanguage = g_strdup_printf("%5.5s, %s;q=0.9, %s;q=0.8", lang, randlang1, randlang2);
+	g_object_set(G_OBJECT(s), "accept-language", acceptlanguage, NULL);
+	g_free(acceptlanguage);
 	g_free(randlang1);
 	g_free(randlang2);
 }
@@ -1649,11 +5101,10 @@ acceptlanguagescramble() {
 static void
 useragentscramble(WebKitWebView *view) {
 	WebKitWebSettings *settings = webkit_web_view_get_settings(view);
-	gchar *ua = strentropy();
-	if (!ua) 
-		ua = " "; /* fallback to blank user-agent -- NULL or "" return a webkit default string that leaks information */
-	g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
-	g_free(ua);
+
+	if (!scrambledua && !(scrambledua = strentropy()))
+		scrambledua = g_strdup(" "); /* fallback to blank user-agent -- NULL or "" return a webkit default string that leaks information */
+	g_object_set(G_OBJECT(settings), "user-agent", scrambledua, NULL);
 }
 
 static void
@@ -1677,12 +5128,156 @@ titlechange(WebKitWebView *view, GParamSpec *pspec, Client *c) {
 	}
 }
 
+/*
+ * Appends an event in Chrome's trace event format. phase is 'B' or 'E' for
+ * the begin and end of a span, 'i' for an instant. Spans of the loader
+ * threads get a row of their own.
+ */
+static void
+trace(const char *name, char phase) {
+	if(!tracefp)
+		return;
+
+	fprintf(tracefp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%"
+			G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld%s},\n",
+			name, phase, g_get_monotonic_time(), (int)getpid(),
+			(long)syscall(SYS_gettid),
+			phase == 'i' ? ",\"s\":\"p\"" : "");
+}
+
+/* opens $SURF_TRACE/surf-<pid>.json when tracing was asked for */
+static void
+traceinit(void) {
+	const char *dir;
+	char *path;
+
+	if(!(dir = getenv("SURF_TRACE")) || !*dir)
+		return;
+
+	g_mkdir_with_parents(dir, 0700);
+	path = g_strdup_printf("%s/surf-%d.json", dir, (int)getpid());
+	if((tracefp = fopen(path, "w"))) {
+		/* a line at a time, for readers like surf-bench */
+		setvbuf(tracefp, NULL, _IOLBF, 0);
+		fprintf(tracefp, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+				"\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+				(int)getpid(), zygote ? "surf zygote" : "surf");
+	}
+	g_free(path);
+}
+
+/* parses cafile, possibly on its own thread; see tlswait() */
+static gpointer
+tlsload(gpointer unused) {
+	GTlsDatabase *db;
+	GError *error = NULL;
+
+	trace("tls_database", 'B');
+	db = g_tls_file_database_new(cafile, &error);
+	trace("tls_database", 'E');
+
+	if(error) {
+		g_warning("Error loading SSL database %s: %s", cafile, error->message);
+		g_error_free(error);
+	}
+	return db;
+}
+
+/*
+ * Hands the SSL database over to the session, waiting for tlsload() to finish
+ * if need be. This has to happen before the first https request, or soup
+ * would fall back to parsing the system database itself.
+ */
+static void
+tlswait(void) {
+	trace("tls_wait", 'B');
+	tlsdb = g_thread_join(tlsthread);
+	tlsthread = NULL;
+	g_object_set(G_OBJECT(webkit_get_default_session()), "tls-database",
+			tlsdb, NULL);
+	trace("tls_wait", 'E');
+}
+
 static void
 titlechangeleave(void *a, void *b, Client *c) {
 	c->linkhover = NULL;
 	updatetitle(c);
 }
 
+static gboolean
+titleflush(Client *c) {
+	const char *title = (c->title == NULL)? "" : c->title;
+	const Origin *o;
+	char *t, *dl;
+	GSList *l;
+	Download *d;
+	goffset received = 0, size = 0;
+	int ndownloads = 0;
+
+	c->titleid = 0;
+
+	for(l = downloads; l; l = l->next) {
+		d = l->data;
+		if(d->c == c) {
+			received += d->received;
+			size = size != -1 && d->size != -1 ? size + d->size : -1;
+			ndownloads++;
+		}
+	}
+
+	if(showindicators) {
+		if(c->statdirty || !c->togglestat[0]) {
+			gettogglestat(c);
+			c->statdirty = FALSE;
+		}
+		getpagestat(c);
+
+		if(!originstat) {
+			o = originget(origin_uri);
+			originstat = g_strdup(o ? o->host : "-");
+		}
+
+		if(c->linkhover) {
+			t = g_strdup_printf("%s:%s | %s", c->togglestat,
+					pagestat, c->linkhover);
+		} else if(c->progress != 100) {
+			t = g_strdup_printf("[%i%%] %s:%s | %s | %s", c->progress,
+					c->togglestat, pagestat,
+					originstat, title);
+		} else {
+			t = g_strdup_printf(       "%s:%s | %s | %s", 
+					c->togglestat, pagestat,
+					originstat, title);
+		}
+	} else {
+		t = g_strdup(title);
+	}
+	if(ndownloads) {
+		dl = t;
+		if(size > 0) {
+			t = g_strdup_printf("[dl %d%%] %s",
+					(int)(received * 100 / size), dl);
+		} else {
+			t = g_strdup_printf("[dl %" G_GINT64_FORMAT "k] %s",
+					(gint64)received / 1024, dl);
+		}
+		g_free(dl);
+	}
+
+	/* each title set is a round trip to the X server */
+	if(c->wintitle && !strcmp(c->wintitle, t)) {
+		g_free(t);
+	} else {
+		gtk_window_set_title(GTK_WINDOW(c->win), t);
+		g_free(c->wintitle);
+		c->wintitle = t;
+		titlestats.set++;
+		trace("title", 'i');
+	}
+
+	return FALSE;
+}
+
 static void
 toggle(Client *c, const Arg *arg) {
 	WebKitWebSettings *settings;
@@ -1694,6 +5289,7 @@ toggle(Client *c, const Arg *arg) {
 	g_object_get(G_OBJECT(settings), name, &value, NULL);
 	g_object_set(G_OBJECT(settings), name, !value, NULL);
 
+	updatestat(c);
 	reload(c, &a);
 }
 
@@ -1715,7 +5311,7 @@ togglecookiepolicy(Client *c, const Arg *arg) {
 	g_object_set(G_OBJECT(jar), "accept-policy",
 			cookiepolicy_get(), NULL);
 
-	updatetitle(c);
+	updatestat(c);
 	/* Do not reload. */
 }
 
@@ -1725,6 +5321,7 @@ togglegeolocation(Client *c, const Arg *arg) {
 
 	allowgeolocation ^= 1;
 
+	updatestat(c);
 	reload(c, &a);
 }
 
@@ -1766,20 +5363,42 @@ togglescrollbars(Client *c, const Arg *arg) {
 	}
 }
 
+/* compiles s on first use, telling whether it is usable */
+static gboolean
+stylecompile(SiteStyle *s) {
+	char *path, *dir;
+
+	if(s->file)
+		return TRUE;
+	if(!s->regex)
+		return FALSE;
+
+	if(regcomp(&(s->re), s->regex, REG_EXTENDED)) {
+		fprintf(stderr, "Could not compile regex: %s\n", s->regex);
+		s->regex = NULL;
+		return FALSE;
+	}
+	dir = buildpath(styledir);
+	path = g_strconcat(dir, s->style, NULL);
+	s->style = buildpath(path);
+	s->file = g_strconcat("file://", s->style, NULL);
+	g_free(path);
+	g_free(dir);
+
+	return TRUE;
+}
+
 static void
 togglestyle(Client *c, const Arg *arg) {
-	WebKitWebSettings *settings = webkit_web_view_get_settings(c->view);
-	char *uri;
-
 	enablestyles = !enablestyles;
-	uri = enablestyles ? getstyle(geturi(c)) : g_strdup("");
-	g_object_set(G_OBJECT(settings), "user-stylesheet-uri", uri, NULL);
+	setstyle(c, enablestyles ? getstyle(geturi(c)) : "");
 
-	updatetitle(c);
+	updatestat(c);
 }
 
 static void
 gettogglestat(Client *c){
+	char *togglestat = c->togglestat;
 	gboolean value;
 	int p = 0;
 	WebKitWebSettings *settings = webkit_web_view_get_settings(c->view);
@@ -1826,44 +5445,92 @@ getpagestat(Client *c) {
 }
 
 static void
-updatetitle(Client *c) {
-	char *t;
-	char *originstat;
+undiscard(Client *c) {
+	c->discarded = FALSE;
+	c->restorey = c->discardy;
+	trace("undiscard", 'i');
+	/* loads the uri the empty page stood in for, revalidating the cache */
+	webkit_web_view_reload(c->view);
+	g_free(c->discarduri);
+	c->discarduri = NULL;
+}
 
-	if(originhas(origin_uri)) {
-		originstat = origingethost(origin_uri);
-	} else {
-		originstat = g_strdup("-");
-	}
-			
+/* for when the indicators may have changed as well */
+static void
+updatestat(Client *c) {
+	c->statdirty = TRUE;
+	updatetitle(c);
+}
 
-	if(showindicators) {
-		gettogglestat(c);
-		getpagestat(c);
+/*
+ * Schedules the window title to be rebuilt. Titles change on every progress
+ * step and link hover, so they are set once per main loop iteration, right
+ * after the redraws.
+ */
+static void
+updatetitle(Client *c) {
+	titlestats.updates++;
+	if(c->titleid) {
+		titlestats.coalesced++;
+		return;
+	}
+	c->titleid = g_idle_add_full(GDK_PRIORITY_REDRAW + 1,
+			(GSourceFunc)titleflush, c, NULL);
+}
 
-		if(c->linkhover) {
-			t = g_strdup_printf("%s:%s | %s", togglestat,
-					pagestat, c->linkhover);
-		} else if(c->progress != 100) {
-			t = g_strdup_printf("[%i%%] %s:%s | %s | %s", c->progress,
-					togglestat, pagestat,
-					originstat,
-					(c->title == NULL)? "" : c->title);
-		} else {
-			t = g_strdup_printf(       "%s:%s | %s | %s", 
-					togglestat, pagestat,
-					originstat,
-					(c->title == NULL)? "" : c->title);
+/*
+ * Tells in a single pass over uri what beforerequest() needs to know about it,
+ * see the Uri* flags. data: uris can be megabytes long, they are done with
+ * after their scheme.
+ */
+static int
+uriclassify(const char *uri) {
+	const char *p;
+	int kind = UriPrint;
+	size_t n;
+
+	for(p = uri; g_ascii_isalnum(*p) || *p == '+' || *p == '-' || *p == '.';
+			p++);
+	n = p - uri;
+	if(*p == ':') {
+		switch(n) {
+		case 4:
+			if(!strncmp(uri, "data", 4))
+				return UriWeb | UriPrint;
+			if(!strncmp(uri, "blob", 4)
+					|| (!strncmp(uri, "http", 4)
+						&& !strncmp(p, "://", 3))
+					|| (!strncmp(uri, "file", 4)
+						&& !strncmp(p, "://", 3))) {
+				kind |= UriWeb;
+			}
+			break;
+		case 5:
+			if(!strncmp(uri, "about", 5)) {
+				kind |= UriWeb;
+			} else if(!strncmp(uri, "https", 5)
+					&& !strncmp(p, "://", 3)) {
+				kind |= UriWeb | UriHttps;
+			}
+			break;
 		}
+	}
 
-		gtk_window_set_title(GTK_WINDOW(c->win), t);
-		g_free(t);
+	if(kind & UriWeb) {
+		p += strlen(p);
 	} else {
-		gtk_window_set_title(GTK_WINDOW(c->win),
-				(c->title == NULL)? "" : c->title);
+		for(; *p; p++) {
+			if(!g_ascii_isprint(*p))
+				kind &= ~UriPrint;
+		}
 	}
 
-	g_free(originstat);
+	if(p == uri)
+		return 0;
+	if(p - uri >= 12 && !memcmp(p - 12, "/favicon.ico", 12))
+		kind |= UriFavicon;
+
+	return kind;
 }
 
 static void
@@ -1874,9 +5541,9 @@ updatewinid(Client *c) {
 
 static void
 usage(void) {
-	die("usage: %s [-bBfFgGiIkKnNpPsSvx]"
+	die("usage: %s [-bBfFgGiIkKLnNpPsSvxZ]"
 		" [-a cookiepolicies ] "
-		" [-c cookiefile] [-e xid] [-r scriptfile]"
+		" [-c cookiefile] [-e xid] [-l sessionentry] [-r scriptfile]"
 		" [-t stylefile] [-u useragent] [-z zoomlevel]"
 		" [uri]\n", basename(argv0));
 }
@@ -1884,7 +5551,150 @@ usage(void) {
 static void
 windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame, JSContextRef js,
 		JSObjectRef win, Client *c) {
-	runscript(frame);
+	char *script;
+
+	if(backgroundthrottle && !webkit_web_frame_get_parent(frame)) {
+		script = g_strdup_printf(throttlescript,
+				c->background ? "true" : "false");
+		evalscript(js, script, "");
+		g_free(script);
+	}
+	if(!scriptmainframeonly || !webkit_web_frame_get_parent(frame))
+		runscript(frame);
+}
+
+/*
+ * c went out of sight, or came back. A window merely unfocused may still be
+ * looked at, so it is neither throttled nor emptied.
+ */
+static gboolean
+visibilitychange(GtkWidget *w, GdkEvent *e, Client *c) {
+	if(e->type == GDK_UNMAP) {
+		background(c, TRUE);
+		if(discardafter && !c->discardid && !c->discarded) {
+			c->discardid = g_timeout_add_seconds(discardafter,
+					(GSourceFunc)discard, c);
+		}
+	} else {
+		background(c, FALSE);
+		if(c->discardid) {
+			g_source_remove(c->discardid);
+			c->discardid = 0;
+		}
+		if(c->discarded)
+			undiscard(c);
+	}
+	return FALSE;
+}
+
+/*
+ * Hands cmd over to a running zygote, along with our environment, so the
+ * child behaves as if it had been exec'd by us. Returns FALSE when there is
+ * no zygote listening and the caller has to spawn() by itself.
+ */
+static gboolean
+zygotespawn(char *const *cmd) {
+	extern char **environ;
+	char *path;
+	gboolean sent;
+
+	path = expandpath(zygotesocket);
+	sent = sockputargv(path, environ, cmd);
+	g_free(path);
+
+	return sent;
+}
+
+/* the threads of this process, 0 if they cannot be counted */
+static guint
+zygotethreads(void) {
+	GDir *d;
+	guint n = 0;
+
+	if(!(d = g_dir_open("/proc/self/task", 0, NULL)))
+		return 0;
+	while(g_dir_read_name(d))
+		n++;
+	g_dir_close(d);
+
+	return n;
+}
+
+/*
+ * Runs the zygote: waits for requests on zygotesocket and forks a child for
+ * each of them. Only ever returns in a child, with the argv it was asked to
+ * run with; the environment has been replaced by the requester's.
+ *
+ * A child forked while GLib or WebKit run threads of their own (resolver,
+ * gdbus) would inherit the locks those hold, locked for good. The zygote
+ * checks it is still alone before each fork, and otherwise execs a fresh
+ * surf for the request instead.
+ */
+static char **
+zygotewait(void) {
+	extern char **environ;
+	char *path, *msg, **env, **argv;
+	pid_t pid;
+	int lfd, fd, i;
+
+	setupshared();
+
+	path = buildpath(zygotesocket);
+	if((lfd = socklisten(path)) == -1)
+		die("surf: cannot listen on %s: %s\n", path, strerror(errno));
+	g_free(path);
+
+	for(;;) {
+		if((fd = accept(lfd, NULL, NULL)) == -1) {
+			if(errno == EINTR)
+				continue;
+			die("surf: accept: %s\n", strerror(errno));
+		}
+		msg = sockgetargv(fd, &env, &argv);
+		close(fd);
+
+		if(tracefp)
+			fflush(tracefp);
+		if(msg && argv[0] && zygotethreads() > 1) {
+			fprintf(stderr, "surf: zygote has threads, "
+					"starting %s afresh\n", argv[0]);
+			if(posix_spawnp(&pid, argv[0], NULL, NULL, argv,
+						env[0] ? env : environ)) {
+				fprintf(stderr, "surf: execvp %s failed\n",
+						argv[0]);
+			}
+			g_free(env);
+			g_free(argv);
+			g_free(msg);
+			continue;
+		}
+		if(!msg || !argv[0] || fork() != 0) {
+			g_free(env);
+			g_free(argv);
+			g_free(msg);
+			continue;
+		}
+
+		/* child */
+		close(lfd);
+		setsid();
+		zygotechild = TRUE;
+		/* never hand out the same random bytes as a sibling */
+		randpos = sizeof(randpool);
+
+		clearenv();
+		for(i = 0; env[i]; i++)
+			putenv(env[i]);
+		/* the requester's session, under our own pid */
+		if(tracefp)
+			fclose(tracefp);
+		tracefp = NULL;
+		traceinit();
+
+		/* msg and argv stay around for the lifetime of the child */
+		g_free(env);
+		return argv;
+	}
 }
 
 static void
@@ -1903,14 +5713,10 @@ zoom(Client *c, const Arg *arg) {
 	}
 }
 
-int
-main(int argc, char *argv[]) {
-	Arg arg;
-	Client *c;
+/* return value must be freed with g_free() */
+static char *
+parseargs(int argc, char *argv[]) {
 	char *qualified_uri = NULL;
-	char *prompt = NULL;
-
-	memset(&arg, 0, sizeof(arg));
 
 	/* command line args */
 	ARGBEGIN {
@@ -2004,12 +5810,21 @@ main(int argc, char *argv[]) {
 	case 'v':
 		die("surf-"VERSION", ©2009-2014 surf engineers, "
 				"see LICENSE for details\n");
+	case 'l':
+		sessionentry = EARGF(usage());
+		break;
+	case 'L':
+		sessionrestoring = TRUE;
+		break;
 	case 'x':
 		showxid = TRUE;
 		break;
 	case 'z':
 		zoomlevel = strtof(EARGF(usage()), NULL);
 		break;
+	case 'Z':
+		zygote = TRUE;
+		break;
 	default:
 		usage();
 	} ARGEND;
@@ -2019,29 +5834,222 @@ main(int argc, char *argv[]) {
 		}
 	}
 
+	return qualified_uri;
+}
+
+/*
+ * With SURF_BENCH=micro, times the hot paths of surf against the files
+ * surf-bench prepared in $HOME, prints the results and exits.
+ */
+static void
+benchmicro(void) {
+	char *const truecmd[] = { "true", NULL };
+	CookieJar *j;
+	SoupCookieJar *text;
+	char *path, *textpath, *contents, **uris, *heap, name[32];
+	gint64 t;
+	guint lines, n, i, r, kinds = 0, blocked = 0;
+	pid_t pid;
+#ifdef POSIX_SPAWN_SETSID
+	extern char **environ;
+#endif
+
+	/* the whole log is replayed when the jar is opened */
+	path = expandpath(cookiefile);
+	t = g_get_monotonic_time();
+	j = COOKIEJAR(cookiejar_new(path, FALSE, SOUP_COOKIE_JAR_ACCEPT_ALWAYS));
+	t = g_get_monotonic_time() - t;
+	lines = j->logged;
+	printf("cookie log replay   %6u lines  %9.1f ms  %7.3f us/line\n",
+			lines, t / 1000.0, lines ? (double)t / lines : 0.0);
+
+	/* and again, as lines of another process, when it is compacted */
+	j->replayed = 0;
+	t = g_get_monotonic_time();
+	cookiejar_compact(j);
+	t = g_get_monotonic_time() - t;
+	printf("cookie compaction   %6u lines  %9.1f ms\n", lines,
+			t / 1000.0);
+
+	/* cookies set by pages, each a line appended to the log */
+	t = g_get_monotonic_time();
+	for(i = 0; i < 200; i++) {
+		snprintf(name, sizeof(name), "bench%u", i);
+		soup_cookie_jar_add_cookie(SOUP_COOKIE_JAR(j), soup_cookie_new(
+					name, "1", ".bench.test", "/", 3600));
+	}
+	t = g_get_monotonic_time() - t;
+	printf("cookie set, log        200 sets  %9.1f ms  %7.1f us/set\n",
+			t / 1000.0, t / 200.0);
+	g_object_unref(j);
+
+	/*
+	 * the same with SoupCookieJarText, which surf used before: it reads
+	 * the snapshot alone, but rewrites all of it on every change
+	 */
+	textpath = g_strconcat(path, ".text", NULL);
+	if(g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_file_set_contents(textpath, contents, -1, NULL);
+		g_free(contents);
+		t = g_get_monotonic_time();
+		text = soup_cookie_jar_text_new(textpath, FALSE);
+		t = g_get_monotonic_time() - t;
+		printf("cookie text load                  %9.1f ms\n",
+				t / 1000.0);
+		t = g_get_monotonic_time();
+		for(i = 0; i < 200; i++) {
+			snprintf(name, sizeof(name), "bench%u", i);
+			soup_cookie_jar_add_cookie(text, soup_cookie_new(name,
+						"1", ".bench.test", "/", 3600));
+		}
+		t = g_get_monotonic_time() - t;
+		printf("cookie set, text       200 sets  %9.1f ms  "
+				"%7.1f us/set\n", t / 1000.0, t / 200.0);
+		g_object_unref(text);
+		g_unlink(textpath);
+	}
+	g_free(textpath);
+	g_free(path);
+
+	/*
+	 * starting a child the way spawn() does, and with fork(), from a
+	 * process holding a heap as large as a loaded WebKit one
+	 */
+	heap = g_malloc(256 << 20);
+	memset(heap, 1, 256 << 20);
+	for(r = 0; r < 2; r++) {
+		t = g_get_monotonic_time();
+		for(i = 0; i < 100; i++) {
+#ifdef POSIX_SPAWN_SETSID
+			if(r == 0) {
+				if(posix_spawnp(&pid, truecmd[0], NULL, NULL,
+							truecmd, environ))
+					pid = -1;
+			} else
+#endif
+			if((pid = fork()) == 0) {
+				execvp(truecmd[0], truecmd);
+				_exit(127);
+			}
+			if(pid > 0)
+				waitpid(pid, NULL, 0);
+		}
+		t = g_get_monotonic_time() - t;
+		printf("spawn %-13s %6ld kB rss %9.1f us/child\n",
+#ifdef POSIX_SPAWN_SETSID
+				r == 0 ? "posix_spawn" : "fork+exec",
+#else
+				"fork+exec",
+#endif
+				rsskb(), t / 100.0);
+	}
+	g_free(heap);
+
+	/* request uris, one per line, recorded or made up by surf-bench */
+	if(!getenv("SURF_BENCH_URIS") || !g_file_get_contents(
+				getenv("SURF_BENCH_URIS"), &contents, NULL, NULL))
+		exit(EXIT_SUCCESS);
+	uris = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for(n = 0; uris[n]; n++);
+
+	t = g_get_monotonic_time();
+	for(r = 0; r < 100; r++) {
+		for(i = 0; i < n; i++)
+			kinds += uriclassify(uris[i]);
+	}
+	t = g_get_monotonic_time() - t;
+	printf("uriclassify         %6u uris   %9.1f ns/uri (%u)\n", n,
+			n ? t * 1000.0 / (100.0 * n) : 0.0, kinds & 1);
+
+	/* the same uris against blockfile, as beforerequest() would */
+	t = g_get_monotonic_time();
+	blockload();
+	t = g_get_monotonic_time() - t;
+	if(blockindex) {
+		printf("block list compile                %9.1f ms\n",
+				t / 1000.0);
+		t = g_get_monotonic_time();
+		for(r = 0; r < 100; r++) {
+			for(i = 0; i < n; i++) {
+				if(uriclassify(uris[i]) & UriWeb
+						&& blockmatch(uris[i]))
+					blocked++;
+			}
+		}
+		t = g_get_monotonic_time() - t;
+		printf("blockmatch          %6u uris   %9.1f ns/uri "
+				"(%u blocked)\n", n,
+				n ? t * 1000.0 / (100.0 * n) : 0.0,
+				blocked / 100);
+	}
+	g_strfreev(uris);
+
+	exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char *argv[]) {
+	Client *c;
+	char *qualified_uri = NULL;
+	char **zargv;
+
+	qualified_uri = parseargs(argc, argv);
+	if(getenv("SURF_BENCH") && !strcmp(getenv("SURF_BENCH"), "micro"))
+		benchmicro();
+	traceinit();
+	if(zygote) {
+		g_free(qualified_uri);
+		zargv = zygotewait();
+		for(argc = 0; zargv[argc]; argc++);
+		zygote = FALSE;
+		qualified_uri = parseargs(argc, zargv);
+	}
+	if(sessionrestoring) {
+		sessionrestore();
+		return EXIT_SUCCESS;
+	}
+	if(sessionentry) {
+		g_free(qualified_uri);
+		qualified_uri = sessionload(sessionentry);
+	}
+	trace("main", 'B');
+	if(getenv("SURF_SPAWNTIME")) {
+		spawntime = g_ascii_strtoll(getenv("SURF_SPAWNTIME"), NULL, 10);
+		g_unsetenv("SURF_SPAWNTIME");
+	}
+
 	setup(qualified_uri);
+	if(qualified_uri && originhas(qualified_uri))
+		origin_uri = qualified_uri;
 	c = newclient();
+	trace("main", 'E');
 	updatewinid(c);
+	c->restorey = restorey;
+	if(restoretoggles) {
+		g_object_set(G_OBJECT(webkit_web_view_get_settings(c->view)),
+				"auto-load-images",
+				strchr(restoretoggles, 'I') != NULL,
+				"enable-scripts",
+				strchr(restoretoggles, 'S') != NULL,
+				"enable-plugins",
+				strchr(restoretoggles, 'V') != NULL,
+				"enable-caret-browsing",
+				strchr(restoretoggles, 'C') != NULL, NULL);
+		webkit_web_view_set_zoom_level(c->view, restorezoom);
+		g_free(restoretoggles);
+		restoretoggles = NULL;
+	}
 	if(qualified_uri) {
-		if (originhas(qualified_uri)) {
-			origin_uri = qualified_uri;
-		}
-		if (sameoriginpolicy && referring_origin && (strcmp(referring_origin, "-") == 0 || !originmatch(referring_origin, qualified_uri))) {
-			setatom(c, AtomUri, qualified_uri);
-			prompt = g_strdup_printf(PROMPT_ORIGIN, referring_origin);
-			arg = (Arg)SETPROP("_SURF_URI", "_SURF_GO", prompt);
-			spawn(c, &arg);
-			g_free(prompt);
-		} else {
-			arg.v = qualified_uri;
-			loaduri(clients, &arg, 0);
-		}
+		openuri(c, qualified_uri, referring_origin);
 	} else {
 		updatetitle(c);
 	}
 
 	gtk_main();
 	cleanup();
+	if(tracefp)
+		fclose(tracefp);
 
 	g_free(qualified_uri);
 